@@ -0,0 +1,393 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include <unordered_set>
+#include <vector>
+
+#include "./enforce.h"
+#include "./pickthread.h"
+#include "./preflight.h"
+#include "./pressure.h"
+#include "./procstat.h"
+#include "./rlim.h"
+
+#define WHEEL_SLOTS 256
+// a process is sampled at most 1/TICKS_PER_INTERVAL of an interval late
+#define TICKS_PER_INTERVAL 16
+// processes far from their limit back off to this many intervals
+#define MAX_BACKOFF 8
+
+namespace {
+struct watched {
+  pid_t pid;
+  int dirfd;
+  int stat_fd;    // only for NPROC and AS
+  int status_fd;  // only for MEMLOCK
+  int limits_fd;
+  int delay_ms;
+  int rounds;  // full turns of the wheel left before the process is due
+};
+
+enum raise_result {
+  RAISE_DONE,
+  RAISE_DEFERRED,  // the target is in uninterruptible sleep, try again soon
+  RAISE_SKIPPED,   // the target cannot be attached to right now
+  RAISE_FAILED,
+};
+}  // namespace
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int) { stopping = 1; }
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool out_of_fds(int err) { return err == EMFILE || err == ENFILE; }
+
+// Each watched process holds up to three fds, so the usual soft limit of 1024
+// would cap the daemon at a few hundred processes.
+static void raise_own_nofile(size_t watch) {
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim)) {
+    PLOG(WARNING) << "getrlimit(RLIMIT_NOFILE)";
+    return;
+  }
+  if (lim.rlim_cur < lim.rlim_max) {
+    const rlim_t was = lim.rlim_cur;
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim)) {
+      PLOG(WARNING) << "failed to raise own NOFILE soft limit";
+      lim.rlim_cur = was;
+    } else {
+      LOG(INFO) << "raised own NOFILE soft limit from " << was << " to "
+                << lim.rlim_cur;
+    }
+  }
+  if (lim.rlim_cur != RLIM_INFINITY && watch * 3 + 16 > lim.rlim_cur) {
+    LOG(WARNING) << "NOFILE limit " << lim.rlim_cur << " may not be enough "
+                 << "to watch " << watch << " processes";
+  }
+}
+
+bool daemon_can_watch(int resource) {
+  return resource == RLIMIT_NOFILE || resource == RLIMIT_NPROC ||
+         resource == RLIMIT_AS || resource == RLIMIT_MEMLOCK;
+}
+
+// procfs regenerates a file on every read from offset 0, so a descriptor
+// opened once can be sampled with a single pread.
+static bool pread_file(int fd, char *buf, size_t sz) {
+  if (fd == -1) {
+    return false;
+  }
+  const ssize_t n = pread(fd, buf, sz - 1, 0);
+  if (n <= 0) {
+    return false;
+  }
+  buf[n] = '\0';
+  return true;
+}
+
+static bool open_watched(pid_t pid, int resource, struct watched *w) {
+  w->pid = pid;
+  w->stat_fd = w->status_fd = w->limits_fd = -1;
+  w->dirfd = open_proc_dir(pid);
+  if (w->dirfd == -1) {
+    return false;
+  }
+  w->limits_fd = openat(w->dirfd, "limits", O_RDONLY | O_CLOEXEC);
+  if (resource == RLIMIT_NPROC || resource == RLIMIT_AS) {
+    w->stat_fd = openat(w->dirfd, "stat", O_RDONLY | O_CLOEXEC);
+  } else if (resource == RLIMIT_MEMLOCK) {
+    w->status_fd = openat(w->dirfd, "status", O_RDONLY | O_CLOEXEC);
+  }
+  return w->limits_fd != -1 &&
+         (resource == RLIMIT_NOFILE || w->stat_fd != -1 || w->status_fd != -1);
+}
+
+static void close_watched(struct watched *w) {
+  for (int fd : {w->stat_fd, w->status_fd, w->limits_fd, w->dirfd}) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  w->stat_fd = w->status_fd = w->limits_fd = w->dirfd = -1;
+}
+
+// Sample only what resource needs. Returns false with errno set to ESRCH once
+// the process is gone; any other failure may be transient.
+static bool sample(const struct watched *w, int resource, struct usage *u) {
+  char buf[4096];
+  errno = 0;
+  memset(u, 0, sizeof(*u));
+  u->pid = w->pid;
+  u->fds = -1;
+  if (!pread_file(w->limits_fd, buf, sizeof(buf))) {
+    return false;
+  }
+  parse_proc_limits(buf, w->pid, u->limits);
+
+  struct proc_stat st;
+  struct proc_status status;
+  switch (resource) {
+    case RLIMIT_NOFILE:
+      u->fds = count_proc_fds(w->dirfd, "fd");
+      return u->fds >= 0;
+    case RLIMIT_NPROC:
+    case RLIMIT_AS:
+      if (!pread_file(w->stat_fd, buf, sizeof(buf)) ||
+          !parse_proc_stat(buf, w->pid, &st)) {
+        return false;
+      }
+      u->threads = st.num_threads;
+      u->vsize = st.vsize;
+      return true;
+    case RLIMIT_MEMLOCK:
+      if (!pread_file(w->status_fd, buf, sizeof(buf))) {
+        return false;
+      }
+      parse_proc_status(buf, w->pid, &status);
+      u->locked = status.vm_lck;
+      return true;
+  }
+  return false;
+}
+
+static enum raise_result raise_soft(const struct daemon_config *config,
+                                    const struct usage *u) {
+  const struct rlimit &lim = u->limits[config->resource];
+  rlim_t soft = lim.rlim_max;
+  if (config->step && lim.rlim_cur < lim.rlim_max - config->step) {
+    soft = lim.rlim_cur + config->step;
+  }
+
+  pid_t tid = u->pid;
+  const char *why = "pid as given";
+  if (config->pick_thread) {
+    tid = PickQuietThread(u->pid, &why);
+  }
+  const char *reason;
+  if (config->preflight) {
+    switch (preflight_classify(tid, &reason)) {
+      case PREFLIGHT_DEFER:
+        LOG(INFO) << "deferring raise of pid " << u->pid << ", " << reason;
+        return RAISE_DEFERRED;
+      case PREFLIGHT_SKIP:
+        LOG(WARNING) << "not raising pid " << u->pid << ", " << reason;
+        return RAISE_SKIPPED;
+      case PREFLIGHT_READY:
+        break;
+    }
+  }
+  LOG(INFO) << "raising " << rlimit_name(config->resource) << " of pid "
+            << u->pid << " from " << lim.rlim_cur << " to " << soft
+            << " via thread " << tid << " (" << why << ")";
+  const int ret =
+      enforce_soft(tid, config->resource, soft, config->wait_timeout_ms);
+  if (ret) {
+    LOG(WARNING) << "failed to raise " << rlimit_name(config->resource)
+                 << " of pid " << u->pid;
+    return RAISE_FAILED;
+  }
+  return RAISE_DONE;
+}
+
+int RunHeadroomDaemon(struct pids *pids, const struct daemon_config *config) {
+  CHECK(daemon_can_watch(config->resource));
+  CHECK(config->interval_ms > 0);
+
+  raise_own_nofile(pids->sz);
+
+  // Limits and the fd table belong to the thread group, so every task of a
+  // group shares one watcher.
+  int status = 0;
+  std::vector<watched> procs;
+  std::unordered_set<pid_t> seen;
+  procs.reserve(pids->sz);
+  for (size_t i = 0; i < pids->sz; i++) {
+    struct proc_status task;
+    errno = 0;
+    if (!read_proc_status(pids->pids[i], &task)) {
+      if (out_of_fds(errno)) {
+        LOG(ERROR) << "out of file descriptors, cannot watch pid "
+                   << pids->pids[i];
+        status |= 1;
+      } else {
+        LOG(WARNING) << "pid " << pids->pids[i]
+                     << " went away before watching";
+      }
+      continue;
+    }
+    if (!seen.insert(task.tgid).second) {
+      VLOG(1) << "task " << pids->pids[i] << " is watched as thread group "
+              << task.tgid;
+      continue;
+    }
+    struct watched w;
+    if (!open_watched(task.tgid, config->resource, &w)) {
+      const int err = errno;
+      LOG(WARNING) << "cannot watch pid " << task.tgid << ": "
+                   << strerror(err);
+      status |= out_of_fds(err);
+      close_watched(&w);
+      continue;
+    }
+    procs.push_back(w);
+  }
+  LOG(INFO) << "watching " << procs.size() << " processes for "
+            << rlimit_name(config->resource) << " every "
+            << config->interval_ms << "ms";
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  const int tick_ms = config->interval_ms > TICKS_PER_INTERVAL
+                          ? config->interval_ms / TICKS_PER_INTERVAL
+                          : 1;
+  std::vector<size_t> slots[WHEEL_SLOTS], due;
+  size_t cur = 0;
+  auto schedule = [&](size_t idx, int delay_ms) {
+    int ticks = delay_ms / tick_ms;
+    if (ticks < 1) {
+      ticks = 1;
+    }
+    procs[idx].rounds = (ticks - 1) / WHEEL_SLOTS;
+    slots[(cur + ticks) % WHEEL_SLOTS].push_back(idx);
+  };
+
+  // spread the first samples over one interval
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i].delay_ms = config->interval_ms;
+    schedule(i, (long long)i * config->interval_ms / procs.size());
+  }
+
+  size_t live = procs.size();
+  unsigned long long samples = 0, sample_ns = 0, raises = 0;
+  long long report_at = now_ns() + config->report_s * 1000000000LL;
+  const long long report_start = now_ns();
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (live && !stopping) {
+    next.tv_nsec += tick_ms * 1000000L;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+               EINTR &&
+           !stopping) {
+    }
+    cur = (cur + 1) % WHEEL_SLOTS;
+    due.swap(slots[cur]);
+
+    // targets whose first wait timed out are released as soon as they stop,
+    // rather than staying traced (and skipped by preflight) until exit
+    reap_abandoned(0);
+
+    for (const size_t idx : due) {
+      struct watched &w = procs[idx];
+      if (w.rounds > 0) {
+        w.rounds--;
+        slots[cur].push_back(idx);
+        continue;
+      }
+
+      struct usage u;
+      const long long start = now_ns();
+      const bool ok = sample(&w, config->resource, &u);
+      const int err = errno;
+      sample_ns += now_ns() - start;
+      samples++;
+      if (!ok && err == ESRCH) {
+        LOG(INFO) << "pid " << w.pid << " exited, no longer watching it";
+        close_watched(&w);
+        live--;
+        continue;
+      }
+      if (!ok) {
+        LOG(WARNING) << "failed to sample pid " << w.pid << ": "
+                     << (err ? strerror(err) : "short read")
+                     << ", trying again next interval";
+        w.delay_ms = config->interval_ms;
+        schedule(idx, w.delay_ms);
+        continue;
+      }
+
+      const double room = headroom(&u, config->resource);
+      const struct rlimit &lim = u.limits[config->resource];
+      if (room <= 1.0 - config->threshold && lim.rlim_cur < lim.rlim_max) {
+        const enum raise_result ret = raise_soft(config, &u);
+        if (ret == RAISE_DONE || ret == RAISE_FAILED) {
+          raises++;
+        }
+        if (ret == RAISE_SKIPPED || ret == RAISE_FAILED) {
+          status |= 1;
+        }
+        // don't keep stopping a process that cannot be raised
+        w.delay_ms = ret == RAISE_SKIPPED || ret == RAISE_FAILED
+                         ? config->interval_ms * MAX_BACKOFF
+                         : config->interval_ms;
+      } else if (room > 1.0 - config->threshold / 2) {
+        w.delay_ms = w.delay_ms * 2 < config->interval_ms * MAX_BACKOFF
+                         ? w.delay_ms * 2
+                         : config->interval_ms * MAX_BACKOFF;
+      } else {
+        w.delay_ms = config->interval_ms;
+      }
+      schedule(idx, w.delay_ms);
+    }
+    due.clear();
+
+    const long long t = now_ns();
+    if (t >= report_at || !live || stopping) {
+      const double secs = (t - report_start) / 1e9;
+      LOG(INFO) << "watching " << live << " processes: " << samples
+                << " samples, " << raises << " raises, "
+                << (samples ? sample_ns / samples / 1000.0 : 0)
+                << "us per sample, "
+                << (secs > 0 ? sample_ns / 1000.0 / secs / procs.size() : 0)
+                << "us/s of sampling per process";
+      report_at = t + config->report_s * 1000000000LL;
+    }
+  }
+
+  for (auto &w : procs) {
+    close_watched(&w);
+  }
+  LOG(INFO) << "headroom daemon exiting with status " << status;
+  return status;
+}
@@ -0,0 +1,47 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "./pids.h"
+
+struct daemon_config {
+  int resource;         // NOFILE, NPROC, AS or MEMLOCK
+  int interval_ms;      // how often a process near its limit is sampled
+  double threshold;     // utilization of the soft limit that triggers a raise
+  rlim_t step;          // how far to raise the soft limit, 0 for the hard limit
+  int wait_timeout_ms;  // passed on to enforce_soft()
+  bool pick_thread;     // inject into an idle thread, see PickQuietThread()
+  bool preflight;       // classify a target first, see preflight_classify()
+  int report_s;         // how often to log the sampling overhead
+};
+
+// Whether the daemon can sample usage of resource.
+bool daemon_can_watch(int resource);
+
+// Keep the /proc files of every thread group in pids open and sample them
+// with pread() on a timer wheel, raising the soft limit of a process just
+// before it is reached rather than up front. Processes far from their limit
+// are sampled less often. Runs until every process has exited or
+// SIGINT/SIGTERM arrives, and returns nonzero if any raise failed or was
+// skipped by preflight.
+int RunHeadroomDaemon(struct pids *pids, const struct daemon_config *config);
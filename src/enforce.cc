@@ -25,176 +25,434 @@
 #include <glog/logging.h>
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <syscall.h>
+#include <time.h>
 
+#include <unordered_set>
+#include <vector>
+
+#include "./procstat.h"
 #include "./rlim.h"
 
-static void do_wait(pid_t pid) {
+// The x86-64 ABI lets leaf code keep live data in the 128 bytes below rsp,
+// so the struct rlimit passed to the injected syscalls goes below that.
+#define RED_ZONE 128
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Targets whose first stop did not arrive in time. They are still seized
+// with an interrupt pending, and are detached by reap_abandoned() once they
+// stop.
+static std::vector<pid_t> abandoned;
+
+namespace {
+enum wait_result {
+  WAIT_STOPPED,  // a ptrace trap or event stop, ready for the next request
+  WAIT_SIGNAL,   // a signal-delivery-stop; the signal must go back on detach
+  WAIT_TIMEOUT,  // still running after timeout_ms
+  WAIT_GONE,     // exited, or could not be waited for
+};
+}  // namespace
+
+// The signal of a signal-delivery-stop, or 0 for the SIGTRAP of a single step
+// or interrupt and for event stops, none of which should be re-delivered.
+static int delivery_signal(int status) {
+  if ((status >> 16) != 0) {
+    return 0;
+  }
+  const int sig = WSTOPSIG(status);
+  return sig == SIGTRAP || sig == (SIGTRAP | 0x80) ? 0 : sig;
+}
+
+// Wait for pid to stop. With timeout_ms >= 0, poll with a growing sleep so
+// that a target that never stops costs at most timeout_ms rather than
+// blocking the whole batch; a negative timeout_ms blocks. __WALL is needed
+// to wait for threads other than the thread group leader. For WAIT_SIGNAL,
+// *sig is set to the signal that stopped pid.
+static enum wait_result do_wait(pid_t pid, int timeout_ms, int *sig) {
   int status;
   LOG(INFO) << "calling waitpid on pid " << pid;
-  pid_t waited = waitpid(pid, &status, 0);
+  pid_t waited;
+  if (timeout_ms < 0) {
+    while ((waited = waitpid(pid, &status, __WALL)) == -1 && errno == EINTR) {
+    }
+  } else {
+    const long deadline = now_ms() + timeout_ms;
+    struct timespec nap = {0, 50000};
+    while ((waited = waitpid(pid, &status, WNOHANG | __WALL)) == 0) {
+      if (now_ms() >= deadline) {
+        LOG(ERROR) << "timed out after " << timeout_ms
+                   << "ms waiting for pid " << pid << " to stop";
+        return WAIT_TIMEOUT;
+      }
+      nanosleep(&nap, NULL);
+      if (nap.tv_nsec < 10000000) {
+        nap.tv_nsec *= 2;
+      }
+    }
+  }
   if (waited == (pid_t)-1) {
     LOG(WARNING) << "failed to waitpid on pid " << pid;
-    return;
+    return WAIT_GONE;
   }
-  assert(waited != (pid_t)-1);
   assert(waited == pid);
 
   if (WIFEXITED(status)) {
-    LOG(FATAL) << "pid " << pid << " decided to exit";
+    LOG(WARNING) << "pid " << pid << " exited";
+    return WAIT_GONE;
   }
   if (WIFSIGNALED(status)) {
-    LOG(WARNING) << "pid " << pid << " received signal " << WTERMSIG(status);
-  }
-  if (WIFSTOPPED(status)) {
-    assert(WSTOPSIG(status) == SIGTRAP);
-    LOG(INFO) << "pid " << pid << " stopped due to SIGTRAP";
-    LOG(INFO) << "status & 0x80 = " << std::hex << (status & 0x80);
-    LOG(INFO) << "status & (SIGTRAP | 0x80) = " << std::hex
-              << (status & (SIGTRAP | 0x80));
-  } else {
-    LOG(FATAL) << "pid " << pid << " did not stop";
+    LOG(WARNING) << "pid " << pid << " was killed by signal "
+                 << WTERMSIG(status);
+    return WAIT_GONE;
   }
-}
-
-int enforce(pid_t pid, int resource) {
-  LOG(INFO) << "pid is " << pid;
-  if (ptrace(PTRACE_SEIZE, pid, 0, PTRACE_O_TRACESYSGOOD)) {
-    perror("ptrace(PRACE_SEIZE, ...)");
-    return 1;
+  if (!WIFSTOPPED(status)) {
+    LOG(WARNING) << "pid " << pid << " did not stop";
+    return WAIT_GONE;
   }
-
-  if (ptrace(PTRACE_INTERRUPT, pid, 0, 0)) {
-    perror("ptrace(PRACE_INTERRUPT, ...)");
-    return 1;
+  *sig = delivery_signal(status);
+  if (*sig) {
+    LOG(WARNING) << "pid " << pid << " stopped for signal " << *sig
+                 << " instead of the expected trap";
+    return WAIT_SIGNAL;
   }
+  LOG(INFO) << "pid " << pid << " stopped, status " << std::hex << status
+            << std::dec;
+  return WAIT_STOPPED;
+}
 
-  do_wait(pid);
+size_t reap_abandoned(int timeout_ms) {
+  const long deadline = now_ms() + timeout_ms;
+  const struct timespec nap = {0, 10000000};
+  while (true) {
+    for (size_t i = 0; i < abandoned.size();) {
+      const pid_t pid = abandoned[i];
+      int status;
+      const pid_t waited = waitpid(pid, &status, WNOHANG | __WALL);
+      if (waited == 0) {
+        i++;
+        continue;
+      }
+      if (waited == pid && WIFSTOPPED(status)) {
+        LOG(INFO) << "abandoned pid " << pid << " stopped, detaching";
+        if (ptrace(PTRACE_DETACH, pid, 0, delivery_signal(status))) {
+          perror("ptrace(PTRACE_DETACH...");
+        }
+      }
+      abandoned[i] = abandoned.back();
+      abandoned.pop_back();
+    }
+    if (abandoned.empty() || now_ms() >= deadline) {
+      return abandoned.size();
+    }
+    nanosleep(&nap, NULL);
+  }
+}
 
+// What enforce_soft() has changed in the target, so that every exit path can
+// undo exactly that.
+namespace {
+struct seized {
+  pid_t tid;
+  int sig;  // signal to deliver on detach, see delivery_signal()
+};
+
+struct injection {
+  pid_t pid;
+  int sig;  // signal to deliver to pid on detach
   struct user_regs_struct orig;
-  if (ptrace(PTRACE_GETREGS, pid, 0, &orig)) {
-    perror("ptrace(PTRACE_GETREGS, ...)");
-    return 1;
+  unsigned long syscall_at;   // address of the syscall instruction to run
+  bool poked;                 // whether syscall_at was written by us
+  long orig_word;             // the word at syscall_at before it was poked
+  unsigned long scratch;      // stack address of the struct rlimit argument
+  bool saved;                 // whether orig_scratch holds what was there
+  struct rlimit orig_scratch;
+  std::vector<seized> group;  // other threads stopped while text is poked
+};
+}  // namespace
+
+static void detach_group(const std::vector<seized> &group) {
+  for (const seized &t : group) {
+    if (ptrace(PTRACE_DETACH, t.tid, 0, t.sig)) {
+      perror("ptrace(PTRACE_DETACH...");
+    }
   }
-  LOG(INFO) << "orig.rip = " << (void*)orig.rip;
+}
 
-  errno = 0;
-  const long orig_word = ptrace(PTRACE_PEEKTEXT, pid, orig.rip, 0);
-  if (orig_word == -1 && errno) {
-    perror("ptrace(PTRACE_PEEKTEXT, ...)");
-    return 1;
+// Put back the original text and registers and let the threads go. Every
+// path after the registers or text have been changed goes through here, so
+// the target never runs the injected instruction once setrlimit is done. A
+// signal that stopped the target meanwhile is delivered on detach.
+static int restore(const struct injection &inj) {
+  LOG(INFO) << "restoring process to original state";
+  int ret = 0;
+  if (inj.poked &&
+      ptrace(PTRACE_POKETEXT, inj.pid, inj.syscall_at, inj.orig_word)) {
+    perror("ptrace(PTRACE_POKETEXT...");
+    ret = 1;
   }
-
-  LOG(INFO) << "orig_word is " << orig_word;
-
-  if (ptrace(PTRACE_POKETEXT, pid, orig.rip, 0x050f)) {
-    perror("ptrace(PTRACE_POKETEXT, ...)");
-    return 1;
+  struct rlimit scratch = inj.orig_scratch;
+  if (inj.saved && !poke_rlimit(inj.pid, inj.scratch, &scratch)) {
+    ret = 1;
   }
+  if (ptrace(PTRACE_SETREGS, inj.pid, 0, &inj.orig)) {
+    perror("ptrace(PTRACE_SETREGS...");
+    ret = 1;
+  }
+  if (ptrace(PTRACE_DETACH, inj.pid, 0, inj.sig)) {
+    perror("ptrace(PTRACE_DETACH...");
+    ret = 1;
+  }
+  // the text is back, so the rest of the group may run again
+  detach_group(inj.group);
+  return ret;
+}
 
-  LOG(INFO) << "poked text to prepare for syscall";
-
-  struct user_regs_struct new_regs;
-  memcpy(&new_regs, &orig, sizeof(new_regs));
-
-  new_regs.rax = SYS_getrlimit;                         // sys_getrlimit
-  new_regs.rdi = resource;                              // resource
-  new_regs.rsi = new_regs.rsp - sizeof(struct rlimit);  // rlim
+// Seize and stop every other thread of pid's thread group, so that none of
+// them can run through text that is about to be poked. A thread cloned while
+// the task directory was being read would be missed, so it is read again
+// once everything found so far is stopped, until a pass finds no new tids;
+// by then no running thread is left to clone another. Returns false (with
+// everything it stopped detached again) if any thread would not stop.
+static bool stop_thread_group(pid_t pid, int timeout_ms,
+                              std::vector<seized> *group) {
+  struct proc_status status;
+  if (!read_proc_status(pid, &status)) {
+    return false;
+  }
+  char path[PATH_MAX];
+  proc_path(path, sizeof(path), status.tgid, "task");
+  std::unordered_set<pid_t> seen = {pid};
+  bool ok = true;
+  bool found = true;
+  while (ok && found) {
+    DIR *dir = opendir(path);
+    if (dir == nullptr) {
+      ok = false;
+      break;
+    }
+    found = false;
+    struct dirent *ent;
+    while (ok && (ent = readdir(dir)) != nullptr) {
+      char *end;
+      const long tid = strtol(ent->d_name, &end, 10);
+      if (tid <= 0 || *end != '\0' || !seen.insert(tid).second) {
+        continue;
+      }
+      found = true;
+      if (ptrace(PTRACE_SEIZE, tid, 0, 0)) {
+        if (errno == ESRCH) {
+          continue;  // the thread exited in the meantime
+        }
+        perror("ptrace(PTRACE_SEIZE, thread)");
+        ok = false;
+        break;
+      }
+      if (ptrace(PTRACE_INTERRUPT, tid, 0, 0)) {
+        perror("ptrace(PTRACE_INTERRUPT, thread)");
+        ptrace(PTRACE_DETACH, tid, 0, 0);
+        ok = false;
+        break;
+      }
+      // a thread stopped for a signal is just as stopped; the signal goes
+      // back when it is detached
+      seized t = {(pid_t)tid, 0};
+      switch (do_wait(tid, timeout_ms, &t.sig)) {
+        case WAIT_STOPPED:
+        case WAIT_SIGNAL:
+          group->push_back(t);
+          break;
+        case WAIT_TIMEOUT:
+          abandoned.push_back(tid);
+          ok = false;
+          break;
+        case WAIT_GONE:
+          break;
+      }
+    }
+    closedir(dir);
+  }
+  if (!ok) {
+    detach_group(*group);
+    group->clear();
+  }
+  return ok;
+}
 
-  LOG(INFO) << "setting regs for syscall";
-  if (ptrace(PTRACE_SETREGS, pid, 0, &new_regs)) {
+// Run one syscall in the stopped thread with the given registers, which must
+// point rip at inj->syscall_at. The result is left in *regs. Returns false,
+// leaving the target for restore(), if the step did not complete as a
+// successful syscall.
+static bool run_syscall(struct injection *inj, struct user_regs_struct *regs) {
+  LOG(INFO) << "setting regs for syscall " << regs->rax;
+  if (ptrace(PTRACE_SETREGS, inj->pid, 0, regs)) {
     perror("ptrace(PTRACE_SETREGS, ...)");
-    return 1;
+    return false;
   }
-
   LOG(INFO) << "SINGLESTEPing through syscall";
-  if (ptrace(PTRACE_SINGLESTEP, pid, 0, 0)) {
+  if (ptrace(PTRACE_SINGLESTEP, inj->pid, 0, 0)) {
     perror("ptrace(PTRACE_SINGLESTEP, ...)");
-    return 1;
+    return false;
+  }
+  // The registers (and maybe text) are changed, so wait for the step however
+  // long it takes; giving up here would leave the target to run them. A
+  // signal arriving first stops the thread before the syscall runs.
+  if (do_wait(inj->pid, -1, &inj->sig) != WAIT_STOPPED) {
+    return false;
   }
-
-  do_wait(pid);
-
   LOG(INFO) << "SINGLESTEP succeeded, trying to get regs";
-  if (ptrace(PTRACE_GETREGS, pid, 0, &new_regs)) {
+  if (ptrace(PTRACE_GETREGS, inj->pid, 0, regs)) {
     perror("ptrace(PTRACE_GETREGS, ...)");
-    return 1;
+    return false;
   }
-
-  if (new_regs.rip - 2 != orig.rip) {
-    LOG(FATAL) << "expected rip to be increased by 2, instead the delta is %d"
-               << new_regs.rip - orig.rip;
+  if (regs->rip != inj->syscall_at + 2) {
+    LOG(ERROR) << "expected rip to be just past the syscall, instead it is "
+               << (void *)regs->rip;
+    return false;
   }
-  if (new_regs.rax != 0) {
-    LOG(FATAL) << "after kernel call rax != 0, rax = %d" << (long)new_regs.rax;
+  if (regs->rax != 0) {
+    LOG(ERROR) << "after kernel call rax != 0, rax = " << (long)regs->rax;
+    return false;
   }
+  return true;
+}
 
-  struct rlimit rlim;
-  read_rlimit(pid, new_regs.rsp - sizeof(struct rlimit), &rlim);
-  LOG(INFO) << "rlim.rlim_cur = " << rlim.rlim_cur
-            << ", rlim.rlim_max = " << rlim.rlim_max;
+int enforce(pid_t pid, int resource, int timeout_ms) {
+  return enforce_soft(pid, resource, RLIM_INFINITY, timeout_ms);
+}
 
-  if (rlim.rlim_cur == rlim.rlim_max) {
-    LOG(INFO) << "both rlim_cur and rlim_max are " << rlim.rlim_cur
-              << ", mothing more to do";
-  } else {
-    rlim.rlim_cur = rlim.rlim_max;
-    poke_rlimit(pid, orig.rsp - sizeof(struct rlimit), &rlim);
+int enforce_soft(pid_t pid, int resource, rlim_t soft, int timeout_ms) {
+  LOG(INFO) << "pid is " << pid;
+  if (ptrace(PTRACE_SEIZE, pid, 0, PTRACE_O_TRACESYSGOOD)) {
+    perror("ptrace(PRACE_SEIZE, ...)");
+    return 1;
+  }
 
-    memcpy(&new_regs, &orig, sizeof(new_regs));
-    new_regs.rax = SYS_setrlimit;                         // sys_setrlimit
-    new_regs.rdi = resource;                              // resource
-    new_regs.rsi = new_regs.rsp - sizeof(struct rlimit);  // rlim
+  if (ptrace(PTRACE_INTERRUPT, pid, 0, 0)) {
+    perror("ptrace(PRACE_INTERRUPT, ...)");
+    return 1;
+  }
 
-    LOG(INFO) << "setting regs for syscall";
-    if (ptrace(PTRACE_SETREGS, pid, 0, &new_regs)) {
-      perror("ptrace(PTRACE_SETREGS, ...)");
+  // Nothing has been modified yet, so this is the only wait that may give
+  // up. The interrupt is still pending, so remember the target and detach
+  // from it once it does stop.
+  int sig = 0;
+  switch (do_wait(pid, timeout_ms, &sig)) {
+    case WAIT_STOPPED:
+      break;
+    case WAIT_SIGNAL:
+      ptrace(PTRACE_DETACH, pid, 0, sig);
       return 1;
-    }
-
-    LOG(INFO) << "SINGLESTEPPing through sys_getrlimit";
-    if (ptrace(PTRACE_SINGLESTEP, pid, 0, 0)) {
-      perror("ptrace(PTRACE_SINGLESTEP, ...)");
+    case WAIT_TIMEOUT:
+      abandoned.push_back(pid);
       return 1;
-    }
+    case WAIT_GONE:
+      return 1;
+  }
 
-    do_wait(pid);
+  struct injection inj;
+  inj.pid = pid;
+  inj.sig = 0;
+  inj.poked = false;
+  inj.orig_word = 0;
+  inj.saved = false;
+  if (ptrace(PTRACE_GETREGS, pid, 0, &inj.orig)) {
+    perror("ptrace(PTRACE_GETREGS, ...)");
+    ptrace(PTRACE_DETACH, pid, 0, 0);
+    return 1;
+  }
+  LOG(INFO) << "orig.rip = " << (void *)inj.orig.rip;
 
-    LOG(INFO) << "SINGLESTEPP succeeded, trying to get regs";
-    if (ptrace(PTRACE_GETREGS, pid, 0, &new_regs)) {
-      perror("ptrace(PTRACE_GETREGS, ...)");
+  // A thread stopped in a syscall has just executed a syscall instruction at
+  // rip - 2, so it can be reused without touching the text, which other
+  // threads may be running through right now.
+  errno = 0;
+  const long prev_word = ptrace(PTRACE_PEEKTEXT, pid, inj.orig.rip - 2, 0);
+  if ((long)inj.orig.orig_rax >= 0 && (prev_word != -1 || errno == 0) &&
+      (prev_word & 0xffff) == 0x050f) {
+    inj.syscall_at = inj.orig.rip - 2;
+    LOG(INFO) << "reusing the syscall instruction at "
+              << (void *)inj.syscall_at;
+  } else {
+    // Otherwise poke a syscall at rip, with the whole thread group stopped
+    // so that no other thread runs the clobbered word.
+    inj.syscall_at = inj.orig.rip;
+    if (!stop_thread_group(pid, timeout_ms, &inj.group)) {
+      LOG(ERROR) << "could not stop the thread group of " << pid
+                 << " to poke text";
+      ptrace(PTRACE_DETACH, pid, 0, 0);
       return 1;
     }
-
-    if (new_regs.rip - 2 != orig.rip) {
-      LOG(FATAL)
-          << "expected %rip to be increased by 2, instead the delta is %d"
-          << new_regs.rip - orig.rip;
+    errno = 0;
+    inj.orig_word = ptrace(PTRACE_PEEKTEXT, pid, inj.syscall_at, 0);
+    if (inj.orig_word == -1 && errno) {
+      perror("ptrace(PTRACE_PEEKTEXT, ...)");
+      return 1 | restore(inj);
     }
-    if (new_regs.rax != 0) {
-      LOG(FATAL) << "after kernel call rax != 0, rax = %d"
-                 << (long)new_regs.rax;
+    LOG(INFO) << "orig_word is " << inj.orig_word;
+    if (ptrace(PTRACE_POKETEXT, pid, inj.syscall_at,
+               (inj.orig_word & ~0xffffL) | 0x050f)) {
+      perror("ptrace(PTRACE_POKETEXT, ...)");
+      return 1 | restore(inj);
     }
+    inj.poked = true;
+    LOG(INFO) << "poked text to prepare for syscall";
   }
 
-  LOG(INFO) << "restoring process to original state";
+  // the syscalls overwrite this stack slot, so keep what was there
+  inj.scratch = inj.orig.rsp - RED_ZONE - sizeof(struct rlimit);
+  if (!read_rlimit(pid, inj.scratch, &inj.orig_scratch)) {
+    return 1 | restore(inj);
+  }
+  inj.saved = true;
 
-  if (ptrace(PTRACE_POKETEXT, pid, orig.rip, orig_word)) {
-    perror("ptrace(PTRACE_POKETEXT...");
-    return 1;
+  struct user_regs_struct new_regs;
+  memcpy(&new_regs, &inj.orig, sizeof(new_regs));
+  new_regs.rip = inj.syscall_at;
+  new_regs.rax = SYS_getrlimit;  // sys_getrlimit
+  new_regs.rdi = resource;       // resource
+  new_regs.rsi = inj.scratch;    // rlim
+  if (!run_syscall(&inj, &new_regs)) {
+    return 1 | restore(inj);
   }
-  if (ptrace(PTRACE_SETREGS, pid, 0, &orig)) {
-    perror("ptrace(PTRACE_SETREGS...");
-    return 1;
+
+  struct rlimit rlim;
+  if (!read_rlimit(pid, inj.scratch, &rlim)) {
+    return 1 | restore(inj);
   }
-  if (ptrace(PTRACE_DETACH, pid, 0, 0)) {
-    perror("ptrace(PTRACE_DETACH...");
-    return 1;
+  LOG(INFO) << "rlim.rlim_cur = " << rlim.rlim_cur
+            << ", rlim.rlim_max = " << rlim.rlim_max;
+
+  const rlim_t target = soft < rlim.rlim_max ? soft : rlim.rlim_max;
+  if (rlim.rlim_cur >= target) {
+    LOG(INFO) << "rlim_cur is already " << rlim.rlim_cur << " (target "
+              << target << "), nothing more to do";
+  } else {
+    rlim.rlim_cur = target;
+    if (!poke_rlimit(pid, inj.scratch, &rlim)) {
+      return 1 | restore(inj);
+    }
+
+    memcpy(&new_regs, &inj.orig, sizeof(new_regs));
+    new_regs.rip = inj.syscall_at;
+    new_regs.rax = SYS_setrlimit;  // sys_setrlimit
+    new_regs.rdi = resource;       // resource
+    new_regs.rsi = inj.scratch;    // rlim
+    if (!run_syscall(&inj, &new_regs)) {
+      return 1 | restore(inj);
+    }
   }
-  return 0;
+
+  return restore(inj);
 }
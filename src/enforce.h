@@ -17,6 +17,21 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 
-int enforce(pid_t pid, int resource);
+// Raise the soft limit of resource to the hard limit in pid, which may be any
+// thread of the process. Each ptrace stop is waited for at most timeout_ms
+// milliseconds.
+int enforce(pid_t pid, int resource, int timeout_ms);
+
+// Like enforce, but raise the soft limit only as far as soft (capped at the
+// hard limit). A soft limit that is already at least soft is left alone.
+int enforce_soft(pid_t pid, int resource, rlim_t soft, int timeout_ms);
+
+// Only the first stop, before anything in the target is modified, may time
+// out. Such targets stay seized with an interrupt pending; this detaches the
+// ones that have stopped since, waiting up to timeout_ms for the rest, and
+// returns how many are still outstanding.
+size_t reap_abandoned(int timeout_ms);
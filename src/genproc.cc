@@ -0,0 +1,199 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Write a synthetic /proc-shaped tree, for exercising discovery and the
+// /proc readers at production scale without root:
+//
+//   genproc -root=/dev/shm/proc -processes=200000 -threads=4
+//   setrlimit -proc_root=/dev/shm/proc -recursive -plan 1
+//
+// Processes are numbered breadth first from pid 1, each with -fanout
+// children. Extra threads get tids after the last process and, as in the
+// real /proc, are reachable as ROOT/TID but only listed under ROOT/PID/task.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <string>
+
+DEFINE_string(root, "", "directory to write the synthetic /proc into");
+DEFINE_int32(processes, 10000, "number of processes");
+DEFINE_int32(fanout, 8, "children per process");
+DEFINE_int32(threads, 1, "tasks per process, including the leader");
+DEFINE_int32(fds, 16, "open fds per process");
+DEFINE_int32(diverge_percent, 50,
+             "percent of processes whose soft core limit is below the hard "
+             "limit");
+DEFINE_int32(seed, 1, "seed for the per-process usage numbers");
+
+static const char *limit_names[RLIM_NLIMITS] = {
+    "Max cpu time",        "Max file size",         "Max data size",
+    "Max stack size",      "Max core file size",    "Max resident set",
+    "Max processes",       "Max open files",        "Max locked memory",
+    "Max address space",   "Max file locks",        "Max pending signals",
+    "Max msgqueue size",   "Max nice priority",     "Max realtime priority",
+    "Max realtime timeout"};
+
+static void do_mkdir(const std::string &path) {
+  if (mkdir(path.c_str(), 0755) && errno != EEXIST) {
+    LOG(FATAL) << "failed to mkdir " << path << ": " << strerror(errno);
+  }
+}
+
+static void write_file(const std::string &path, const char *buf, size_t sz) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    LOG(FATAL) << "failed to open " << path << ": " << strerror(errno);
+  }
+  if (write(fd, buf, sz) != (ssize_t)sz) {
+    LOG(FATAL) << "short write to " << path << ": " << strerror(errno);
+  }
+  close(fd);
+}
+
+static std::string limits_file(bool diverge) {
+  std::string out;
+  char line[128];
+  snprintf(line, sizeof(line), "%-25s %-20s %-20s %-10s\n", "Limit",
+           "Soft Limit", "Hard Limit", "Units");
+  out += line;
+  for (int r = 0; r < RLIM_NLIMITS; r++) {
+    const char *soft = "unlimited", *hard = "unlimited";
+    if (r == RLIMIT_NOFILE) {
+      soft = "1024";
+      hard = "1048576";
+    } else if (r == RLIMIT_NPROC) {
+      soft = hard = "4096";
+    } else if (r == RLIMIT_MEMLOCK) {
+      soft = hard = "8388608";
+    } else if (r == RLIMIT_CORE && diverge) {
+      soft = "0";
+    }
+    snprintf(line, sizeof(line), "%-25s %-20s %-20s %-10s\n", limit_names[r],
+             soft, hard, "");
+    out += line;
+  }
+  return out;
+}
+
+// write stat, status and limits for one task into dir
+static void write_task(const std::string &dir, pid_t tid, pid_t tgid,
+                       pid_t ppid, unsigned int *seed, const std::string &lim) {
+  char buf[1024];
+  const unsigned long vsize = (1 + rand_r(seed) % 4096) * 1048576UL;
+  const unsigned long long start = rand_r(seed) % 100000000;
+  int n = snprintf(buf, sizeof(buf),
+                   "%d (synth %d) %c %d %d %d 0 -1 4194304 0 0 0 0 0 0 0 0 "
+                   "20 0 %d 0 %llu %lu %lu",
+                   tid, tgid, rand_r(seed) % 8 ? 'S' : 'R', ppid, tgid, tgid,
+                   FLAGS_threads, start, vsize, vsize / 4096 / 4);
+  for (int field = 25; field <= 52; field++) {
+    n += snprintf(buf + n, sizeof(buf) - n, " 0");
+  }
+  n += snprintf(buf + n, sizeof(buf) - n, "\n");
+  write_file(dir + "/stat", buf, n);
+
+  n = snprintf(buf, sizeof(buf),
+               "Name:\tsynth %d\nState:\tS (sleeping)\nTgid:\t%d\nPid:\t%d\n"
+               "PPid:\t%d\nTracerPid:\t0\nVmSize:\t%lu kB\nVmLck:\t%d kB\n"
+               "Threads:\t%d\n",
+               tgid, tgid, tid, ppid, vsize / 1024, rand_r(seed) % 8192,
+               FLAGS_threads);
+  write_file(dir + "/status", buf, n);
+  write_file(dir + "/limits", lim.data(), lim.size());
+}
+
+int main(int argc, char **argv) {
+  google::SetUsageMessage("-root=DIR [OPTIONS]");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  LOG_IF(FATAL, FLAGS_root.empty()) << "you must specify -root";
+  LOG_IF(FATAL, FLAGS_processes < 1 || FLAGS_fanout < 1 || FLAGS_threads < 1)
+      << "-processes, -fanout and -threads must be positive";
+
+  const std::string root = FLAGS_root;
+  do_mkdir(root);
+  const std::string lim_same = limits_file(false);
+  const std::string lim_diverge = limits_file(true);
+  unsigned int seed = FLAGS_seed;
+  pid_t next_tid = FLAGS_processes + 1;
+  std::string children;
+  char num[32];
+
+  for (pid_t pid = 1; pid <= FLAGS_processes; pid++) {
+    const pid_t ppid = pid == 1 ? 0 : (pid - 2) / FLAGS_fanout + 1;
+    const bool diverge = (int)(rand_r(&seed) % 100) < FLAGS_diverge_percent;
+    const std::string &lim = diverge ? lim_diverge : lim_same;
+
+    snprintf(num, sizeof(num), "/%d", pid);
+    const std::string dir = root + num;
+    do_mkdir(dir);
+    do_mkdir(dir + "/task");
+    do_mkdir(dir + "/fd");
+    for (int fd = 0; fd < FLAGS_fds; fd++) {
+      snprintf(num, sizeof(num), "/fd/%d", fd);
+      write_file(dir + num, "", 0);
+    }
+    write_task(dir, pid, pid, ppid, &seed, lim);
+
+    // the leader's task directory carries the children of the process
+    children.clear();
+    const long first = (long)(pid - 1) * FLAGS_fanout + 2;
+    for (long c = first; c < first + FLAGS_fanout && c <= FLAGS_processes;
+         c++) {
+      snprintf(num, sizeof(num), "%ld ", c);
+      children += num;
+    }
+    for (int t = 0; t < FLAGS_threads; t++) {
+      const pid_t tid = t == 0 ? pid : next_tid++;
+      snprintf(num, sizeof(num), "/task/%d", tid);
+      const std::string task = dir + num;
+      do_mkdir(task);
+      write_task(task, tid, pid, ppid, &seed, lim);
+      write_file(task + "/children", children.data(),
+                 t == 0 ? children.size() : 0);
+      if (t != 0) {
+        snprintf(num, sizeof(num), "%d/task/%d", pid, tid);
+        const std::string link = root + "/" + std::to_string(tid);
+        if (symlink(num, link.c_str()) && errno != EEXIST) {
+          LOG(FATAL) << "failed to symlink " << link << ": " << strerror(errno);
+        }
+      }
+    }
+
+    if (pid % 100000 == 0) {
+      LOG(INFO) << "wrote " << pid << " of " << FLAGS_processes << " processes";
+    }
+  }
+  LOG(INFO) << "wrote " << FLAGS_processes << " processes and "
+            << (next_tid - FLAGS_processes - 1) << " extra threads to "
+            << root;
+  return 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Write a small synthetic /proc with genproc and check that discovery and the
+# /proc parsers see exactly what was written, and that the planner picks out
+# exactly the processes genproc made diverge. Larger trees make this a
+# discovery benchmark, e.g.
+#
+#   PROCESSES=200000 THREADS=4 ./genproc_test.sh
+
+set -e
+
+PROCESSES=${PROCESSES:-500}
+FANOUT=${FANOUT:-7}
+THREADS=${THREADS:-3}
+DIVERGE=${DIVERGE:-30}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+./genproc -root="$tmp/proc" -processes="$PROCESSES" -fanout="$FANOUT" \
+  -threads="$THREADS" -fds=4 -diverge_percent="$DIVERGE"
+./proctree_test "$tmp/proc" "$PROCESSES" "$FANOUT" "$THREADS"
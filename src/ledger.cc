@@ -0,0 +1,341 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./ledger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glog/logging.h>
+
+#include <atomic>
+
+#include "./procstat.h"
+
+#define LEDGER_MAGIC 0x736c696d6c656467ULL  // "slimledg"
+#define LEDGER_PROBES 64
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "the ledger needs lock-free 64-bit atomics");
+
+// An all-zero entry is empty, so a freshly truncated file is a valid ledger
+// and there is no initialization race between invocations.
+struct ledger_entry {
+  std::atomic<uint64_t> key;
+  std::atomic<uint64_t> state;
+};
+
+// The header is followed by as many entries as the creator sized the shared
+// memory for; later invocations take the size from the file.
+struct ledger_header {
+  std::atomic<uint64_t> magic;
+  uint64_t reserved;
+};
+
+struct ledger {
+  struct ledger_header *header;
+  ledger_entry *entries;
+  size_t nentries;
+  size_t size;  // of the mapping
+};
+
+// state is packed as status:8 | owner pid:24 | boot time in seconds:32
+enum entry_status {
+  ENTRY_EMPTY = 0,
+  ENTRY_CLAIMED = 1,
+  ENTRY_DONE = 2,
+  ENTRY_FAILED = 3,
+  ENTRY_MOVING = 4,  // being handed to a new key, see find_entry()
+};
+
+static inline uint64_t pack_state(int status, pid_t owner, uint32_t when) {
+  return ((uint64_t)status << 56) | ((uint64_t)(owner & 0xffffff) << 32) |
+         when;
+}
+static inline int state_status(uint64_t s) { return s >> 56; }
+static inline pid_t state_owner(uint64_t s) { return (s >> 32) & 0xffffff; }
+static inline uint32_t state_time(uint64_t s) { return s & 0xffffffff; }
+
+static uint32_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return ts.tv_sec;
+}
+
+// pid_max is at most 2^22, and 36 bits of start time in clock ticks covers
+// decades of uptime.
+static bool make_key(pid_t pid, int resource, uint64_t *key) {
+  struct proc_stat st;
+  if (!read_proc_stat(pid, &st)) {
+    return false;
+  }
+  *key = ((st.starttime & 0xfffffffffULL) << 28) |
+         ((uint64_t)(pid & 0x7fffff) << 5) | (resource & 0x1f);
+  return true;
+}
+
+static bool owner_alive(uint64_t s) {
+  return kill(state_owner(s), 0) == 0 || errno != ESRCH;
+}
+
+// Whether the entry in state s may be handed to a new key: its outcome is
+// older than ttl, or the invocation that claimed or was moving it has died.
+static bool reclaimable(uint64_t s, uint32_t t, int ttl) {
+  switch (state_status(s)) {
+    case ENTRY_DONE:
+    case ENTRY_FAILED:
+      return t - state_time(s) >= (uint32_t)ttl;
+    case ENTRY_CLAIMED:
+    case ENTRY_MOVING:
+      return !owner_alive(s);
+    default:
+      return false;
+  }
+}
+
+// The state of e once any move in progress has finished. A move is three
+// stores by a live invocation, so this spins only briefly; a move abandoned
+// by a dead invocation is returned as is and is reclaimable.
+static uint64_t settled_state(ledger_entry *e) {
+  uint64_t s = e->state.load();
+  while (state_status(s) == ENTRY_MOVING && owner_alive(s)) {
+    sched_yield();
+    s = e->state.load();
+  }
+  return s;
+}
+
+// Look up key. With insert, a missing key takes the first empty slot, or
+// failing that a reclaimable one; a reclaimed slot comes back already
+// claimed by this invocation, which is reported through *claimed. Slots
+// never become empty again, so a probe can still stop at the first empty
+// slot.
+//
+// Reclaiming moves the slot to ENTRY_MOVING with a CAS before the key is
+// replaced, and only then claims it, so nobody sees the new key with the
+// evicted key's state or the evicted key with the new claim. Probes wait out
+// a move in progress; an invocation whose CAS loses probes again, and then
+// finds the key that the winner has just published.
+static ledger_entry *find_entry(struct ledger *ledger, uint64_t key,
+                                bool insert, int ttl, bool *claimed) {
+  // splitmix64 finalizer, to spread out sequential pids
+  uint64_t h = key;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+
+  const uint32_t t = now();
+  while (true) {
+    ledger_entry *stale = NULL;
+    uint64_t stale_state = 0;
+    for (size_t i = 0; i < LEDGER_PROBES; i++) {
+      ledger_entry *e = &ledger->entries[(h + i) % ledger->nentries];
+      const uint64_t s = settled_state(e);
+      uint64_t cur = e->key.load();
+      if (cur == key) {
+        return e;
+      }
+      if (cur == 0) {
+        if (!insert) {
+          return NULL;
+        }
+        if (e->key.compare_exchange_strong(cur, key) || cur == key) {
+          return e;
+        }
+        continue;
+      }
+      if (insert && stale == NULL && reclaimable(s, t, ttl)) {
+        stale = e;
+        stale_state = s;
+      }
+    }
+    if (stale == NULL) {
+      return NULL;
+    }
+
+    if (!stale->state.compare_exchange_strong(
+            stale_state, pack_state(ENTRY_MOVING, getpid(), t))) {
+      continue;  // somebody else got there first, look again
+    }
+    stale->key.store(key);
+    stale->state.store(pack_state(ENTRY_CLAIMED, getpid(), t));
+    *claimed = true;
+    return stale;
+  }
+}
+
+struct ledger *ledger_open(const char *name, mode_t mode, size_t entries) {
+  bool created = true;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+  if (fd == -1 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+  }
+  if (fd == -1) {
+    LOG(ERROR) << "failed to shm_open " << name << ": " << strerror(errno);
+    return NULL;
+  }
+
+  // Only the creator sizes the ledger, so concurrent openers cannot truncate
+  // it to different sizes. The others wait briefly for that to happen.
+  if (created) {
+    // shm_open applies the umask, so set the mode the creator asked for
+    if (fchmod(fd, mode)) {
+      LOG(WARNING) << "failed to chmod ledger " << name << ": "
+                   << strerror(errno);
+    }
+    if (ftruncate(fd, sizeof(struct ledger_header) +
+                          entries * sizeof(ledger_entry))) {
+      LOG(ERROR) << "failed to size ledger " << name << ": "
+                 << strerror(errno);
+      close(fd);
+      return NULL;
+    }
+  }
+  struct stat st;
+  const struct timespec nap = {0, 1000000};
+  for (int i = 0;; i++) {
+    if (fstat(fd, &st)) {
+      LOG(ERROR) << "failed to fstat ledger " << name << ": "
+                 << strerror(errno);
+      close(fd);
+      return NULL;
+    }
+    if (st.st_size > 0 || i == 1000) {
+      break;
+    }
+    nanosleep(&nap, NULL);
+  }
+  if ((size_t)st.st_size < sizeof(struct ledger_header) + sizeof(ledger_entry)) {
+    LOG(ERROR) << "shared memory " << name << " is too small for a ledger";
+    close(fd);
+    return NULL;
+  }
+
+  void *addr =
+      mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    LOG(ERROR) << "failed to mmap ledger " << name << ": " << strerror(errno);
+    return NULL;
+  }
+
+  struct ledger_header *header = (struct ledger_header *)addr;
+  uint64_t magic = 0;
+  if (!header->magic.compare_exchange_strong(magic, LEDGER_MAGIC) &&
+      magic != LEDGER_MAGIC) {
+    LOG(ERROR) << "shared memory " << name << " is not a setrlimit ledger";
+    munmap(addr, st.st_size);
+    return NULL;
+  }
+
+  struct ledger *ledger = (struct ledger *)malloc(sizeof(struct ledger));
+  ledger->header = header;
+  ledger->entries = (ledger_entry *)(header + 1);
+  ledger->size = st.st_size;
+  ledger->nentries =
+      (st.st_size - sizeof(struct ledger_header)) / sizeof(ledger_entry);
+  if (!created && ledger->nentries != entries) {
+    LOG(INFO) << "ledger " << name << " already exists with "
+              << ledger->nentries << " entries";
+  }
+  return ledger;
+}
+
+enum ledger_claim ledger_claim(struct ledger *ledger, pid_t pid, int resource,
+                               int ttl) {
+  uint64_t key;
+  if (!make_key(pid, resource, &key)) {
+    // let enforce() report the missing process
+    return LEDGER_CLAIMED;
+  }
+  bool claimed = false;
+  ledger_entry *e = find_entry(ledger, key, true, ttl, &claimed);
+  if (e == NULL) {
+    LOG(WARNING) << "ledger of " << ledger->nentries
+                 << " entries is full, enforcing pid " << pid << " unclaimed";
+    return LEDGER_CLAIMED;
+  }
+  if (claimed) {
+    return LEDGER_CLAIMED;
+  }
+
+  const uint32_t t = now();
+  const uint64_t mine = pack_state(ENTRY_CLAIMED, getpid(), t);
+  uint64_t cur = settled_state(e);
+  while (true) {
+    // The state is read before the key, and a move replaces the key only
+    // after its CAS on the state, so a matching key means cur is this key's.
+    if (e->key.load() != key) {
+      // the slot was handed to another key, so ours is stale and missing
+      return ledger_claim(ledger, pid, resource, ttl);
+    }
+    const uint32_t age = t - state_time(cur);
+    switch (state_status(cur)) {
+      case ENTRY_DONE:
+        if (age < (uint32_t)ttl) {
+          return LEDGER_DONE;
+        }
+        break;
+      case ENTRY_CLAIMED:
+        if (age < (uint32_t)ttl && owner_alive(cur)) {
+          return LEDGER_BUSY;
+        }
+        LOG(INFO) << "taking over stale claim on pid " << pid << " from "
+                  << state_owner(cur);
+        break;
+      case ENTRY_MOVING:
+        if (owner_alive(cur)) {
+          cur = settled_state(e);
+          continue;
+        }
+        break;
+      default:
+        break;
+    }
+    if (e->state.compare_exchange_weak(cur, mine)) {
+      return LEDGER_CLAIMED;
+    }
+  }
+}
+
+void ledger_publish(struct ledger *ledger, pid_t pid, int resource, bool ok) {
+  uint64_t key;
+  if (!make_key(pid, resource, &key)) {
+    return;
+  }
+  ledger_entry *e = find_entry(ledger, key, false, 0, NULL);
+  if (e == NULL) {
+    return;
+  }
+  e->state.store(pack_state(ok ? ENTRY_DONE : ENTRY_FAILED, getpid(), now()));
+}
+
+void ledger_close(struct ledger *ledger) {
+  munmap(ledger->header, ledger->size);
+  free(ledger);
+}
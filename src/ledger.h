@@ -0,0 +1,58 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A lock-free ledger in shared memory (/dev/shm/NAME) that lets concurrent
+// setrlimit invocations split up work. Entries are keyed by (pid, process
+// start time, resource), so pid reuse never aliases an old entry.
+struct ledger;
+
+enum ledger_claim {
+  LEDGER_CLAIMED,  // the caller owns the target and should enforce it
+  LEDGER_DONE,     // another invocation enforced it less than ttl seconds ago
+  LEDGER_BUSY,     // another live invocation is enforcing it right now
+};
+
+// Open (creating if needed) the ledger with the given shm name, e.g.
+// "/setrlimit". Invocations running as different users can only share a
+// ledger if mode grants them write access, e.g. 0660 plus a common group
+// on /dev/shm/NAME. mode and entries only apply when this call creates the
+// ledger; an existing ledger keeps its size. Returns NULL on error.
+//
+// Each target whose outcome is younger than the ttl passed to ledger_claim()
+// holds an entry, and a target only looks at a window of 64 entries, so
+// entries should comfortably exceed the number of targets per ttl (e.g. the
+// task count of a -recursive run over a whole host). Targets that find no
+// entry are enforced unclaimed.
+struct ledger *ledger_open(const char *name, mode_t mode, size_t entries);
+
+// Try to claim pid/resource for this invocation. Claims held by dead
+// invocations, or older than ttl seconds, are taken over. When the table is
+// crowded, slots of other targets whose outcome is older than ttl, or whose
+// claimer died, are reused.
+enum ledger_claim ledger_claim(struct ledger *ledger, pid_t pid, int resource,
+                               int ttl);
+
+// Record the outcome of enforcing a target previously claimed.
+void ledger_publish(struct ledger *ledger, pid_t pid, int resource, bool ok);
+
+void ledger_close(struct ledger *ledger);
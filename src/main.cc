@@ -21,9 +21,12 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/resource.h>
 
+#include <vector>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
@@ -31,15 +34,141 @@
 #include "./config.h"
 #endif
 
+#include "./daemon.h"
 #include "./enforce.h"
+#include "./ledger.h"
+#include "./pickthread.h"
 #include "./pids.h"
+#include "./planner.h"
+#include "./preflight.h"
+#include "./pressure.h"
+#include "./procstat.h"
 #include "./proctree.h"
 #include "./rlim.h"
 #include "./tolong.h"
+#include "./top.h"
 
 DEFINE_int32(resource, RLIMIT_CORE, "the resource to limit");
 DEFINE_bool(recursive, false, "whether to search recursively");
-DEFINE_bool(list, false, "list rlimits");
+DEFINE_bool(list, false,
+            "report rlimit utilization of every process, least headroom "
+            "first");
+DEFINE_int32(list_top, 20, "number of rows to report with -list");
+DEFINE_string(proc_root, "/proc",
+              "where to read procfs from, e.g. a tree written by genproc");
+DEFINE_bool(plan, false,
+            "only patch processes whose limit diverges, ancestors first");
+DEFINE_bool(pressure, false,
+            "enforce on the pids closest to exhausting a limit first");
+DEFINE_int32(pressure_top, 10, "number of most pressured pids to report");
+DEFINE_string(ledger, "",
+              "shared memory ledger (e.g. /setrlimit) used to split work "
+              "with concurrent invocations");
+DEFINE_string(ledger_mode, "0600",
+              "octal permissions of the ledger when this run creates it, "
+              "e.g. 0660 to share it with a group");
+DEFINE_int32(ledger_ttl, 60,
+             "seconds for which a pid enforced by another invocation is "
+             "skipped");
+DEFINE_int32(ledger_entries, 1 << 18,
+             "targets the ledger can track per -ledger_ttl, when this run "
+             "creates it");
+DEFINE_bool(preflight, true,
+            "classify targets from /proc before attaching to them");
+DEFINE_int32(defer_ms, 5000,
+             "how long to retry targets in uninterruptible sleep");
+DEFINE_int32(wait_timeout_ms, 2000, "per-pid timeout for each ptrace stop");
+DEFINE_bool(daemon, false,
+            "keep sampling the pids and raise the soft limit only when it is "
+            "about to be reached");
+DEFINE_int32(daemon_interval_ms, 1000,
+             "how often a process near its limit is sampled");
+DEFINE_double(daemon_threshold, 0.8,
+              "utilization of the soft limit at which it is raised");
+DEFINE_uint64(daemon_step, 0,
+              "how far to raise the soft limit, 0 to raise it to the hard "
+              "limit");
+DEFINE_int32(daemon_report_s, 60, "how often to log the sampling overhead");
+DEFINE_bool(pick_thread, true,
+            "inject into an idle thread of each process instead of the pid "
+            "given");
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+namespace {
+enum attempt {
+  ATTEMPT_FINISHED,  // enforced, skipped or done by another run
+  ATTEMPT_DEFERRED,  // the chosen thread is in uninterruptible sleep
+  ATTEMPT_BUSY,      // claimed by another run that has not published yet
+};
+
+// A target to try again, with the deadline for leaving uninterruptible sleep
+// (0 until it is first deferred).
+struct retry {
+  pid_t target;
+  long deadline;
+};
+}  // namespace
+
+// One attempt at enforce() on target. The target is claimed in the ledger
+// before anything looks at it, since another run injecting into it shows up
+// as its tracer. The thread to inject into is chosen before preflight, so
+// preflight checks the thread that will actually be seized; a claim that is
+// then deferred or skipped is published as failed, which lets a retry (here
+// or in another run) claim it again. Failures are added to *status; for
+// ATTEMPT_DEFERRED, *reason says why.
+static enum attempt enforce_claimed(struct ledger *ledger, pid_t target,
+                                    int resource, int *status,
+                                    const char **reason) {
+  if (ledger != NULL) {
+    switch (ledger_claim(ledger, target, resource, FLAGS_ledger_ttl)) {
+      case LEDGER_DONE:
+        LOG(INFO) << "pid " << target << " was just done by another run";
+        return ATTEMPT_FINISHED;
+      case LEDGER_BUSY:
+        VLOG(1) << "pid " << target << " is claimed by another run";
+        return ATTEMPT_BUSY;
+      case LEDGER_CLAIMED:
+        break;
+    }
+  }
+  pid_t tid = target;
+  const char *why = "pid as given";
+  if (FLAGS_pick_thread) {
+    tid = PickQuietThread(target, &why);
+  }
+  if (FLAGS_preflight) {
+    switch (preflight_classify(tid, reason)) {
+      case PREFLIGHT_DEFER:
+        if (ledger != NULL) {
+          ledger_publish(ledger, target, resource, false);
+        }
+        return ATTEMPT_DEFERRED;
+      case PREFLIGHT_SKIP:
+        LOG(WARNING) << "skipping pid " << target << " (thread " << tid
+                     << "), " << *reason;
+        if (ledger != NULL) {
+          ledger_publish(ledger, target, resource, false);
+        }
+        *status |= 1;
+        return ATTEMPT_FINISHED;
+      case PREFLIGHT_READY:
+        break;
+    }
+  }
+  LOG(INFO) << "pid " << target << ": using thread " << tid << ", " << why;
+  const int ret = enforce(tid, resource, FLAGS_wait_timeout_ms);
+  if (ledger != NULL) {
+    ledger_publish(ledger, target, resource, ret == 0);
+  }
+  reap_abandoned(0);
+  *status |= ret;
+  return ATTEMPT_FINISHED;
+}
 
 static inline void usage(const char *prog, int status = EXIT_FAILURE) {
   fprintf(stderr, "usage: %s: [-v] [-r] [-R resource] PID...\n", prog);
@@ -54,9 +183,12 @@ int main(int argc, char **argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
   LOG(INFO) << "entered main";
+  set_proc_root(FLAGS_proc_root.c_str());
 
   if (FLAGS_list) {
-    print_rlimits();
+    LOG_IF(FATAL, FLAGS_list_top < 0)
+        << "-list_top must not be negative, got " << FLAGS_list_top;
+    ReportUtilization(FLAGS_list_top);
     return 0;
   }
 
@@ -76,7 +208,6 @@ int main(int argc, char **argv) {
     pids_print(pids);
   }
 
-  return 0;
   if (FLAGS_recursive) {
     LOG(INFO) << "recursively apply limits to descendants";
     AddChildren(pids);
@@ -88,16 +219,124 @@ int main(int argc, char **argv) {
               << pids->pids[i];
   }
 
-  int resource = RLIMIT_CORE;
+  int resource = FLAGS_resource;
+  LOG_IF(FATAL, resource < 0 || resource >= RLIM_NLIMITS)
+      << "invalid resource " << resource;
 
   LOG(INFO) << "final value for resource is: " << resource;
 
+  // -pressure reorders the pids, which would undo the ancestors first order
+  // of -plan
+  LOG_IF(FATAL, FLAGS_plan && FLAGS_pressure)
+      << "-plan and -pressure cannot be used together";
+
+  if (FLAGS_plan) {
+    PlanDivergentTargets(pids, resource);
+  }
+
+  if (FLAGS_pressure) {
+    LOG(INFO) << "ordering pids by remaining headroom";
+    SortByPressure(pids, resource, FLAGS_pressure_top);
+  }
+
+  // the pids in a synthetic tree do not name real processes
+  if (!proc_root_is_procfs()) {
+    LOG(INFO) << FLAGS_proc_root << " is not a procfs, not attaching to "
+              << pids->sz << " pids";
+    return 0;
+  }
+
+  if (FLAGS_daemon) {
+    LOG_IF(FATAL, !daemon_can_watch(resource))
+        << "-daemon can only watch NOFILE, NPROC, AS or MEMLOCK";
+    struct daemon_config config;
+    config.resource = resource;
+    config.interval_ms = FLAGS_daemon_interval_ms;
+    config.threshold = FLAGS_daemon_threshold;
+    config.step = FLAGS_daemon_step;
+    config.wait_timeout_ms = FLAGS_wait_timeout_ms;
+    config.pick_thread = FLAGS_pick_thread;
+    config.preflight = FLAGS_preflight;
+    config.report_s = FLAGS_daemon_report_s;
+    return RunHeadroomDaemon(pids, &config);
+  }
+
+  struct ledger *ledger = NULL;
+  if (!FLAGS_ledger.empty()) {
+    LOG_IF(FATAL, FLAGS_ledger_entries <= 0)
+        << "-ledger_entries must be positive, got " << FLAGS_ledger_entries;
+    ledger = ledger_open(FLAGS_ledger.c_str(),
+                         strtol(FLAGS_ledger_mode.c_str(), NULL, 8),
+                         FLAGS_ledger_entries);
+    LOG_IF(FATAL, ledger == NULL) << "failed to open ledger " << FLAGS_ledger;
+  }
+
   int status = 0;
+  const char *reason;
+  std::vector<retry> retries;
   while (pids->sz) {
     LOG(INFO) << "sz = " << pids->sz;
     const pid_t target = pids_pop(pids, NULL);
     LOG(INFO) << "pids = " << target;
-    status |= enforce(target, resource);
+    switch (enforce_claimed(ledger, target, resource, &status, &reason)) {
+      case ATTEMPT_DEFERRED:
+        LOG(INFO) << "deferring pid " << target << ", " << reason;
+        retries.push_back({target, now_ms() + FLAGS_defer_ms});
+        break;
+      case ATTEMPT_BUSY:
+        retries.push_back({target, 0});
+        break;
+      case ATTEMPT_FINISHED:
+        break;
+    }
+  }
+
+  // Retry deferred targets until they leave uninterruptible sleep or their
+  // deadline passes, and targets claimed by another run until that run
+  // publishes, so that one it failed or timed out on is enforced here rather
+  // than silently counted as done. A claim that is never published goes
+  // stale after -ledger_ttl and is taken over.
+  if (!retries.empty()) {
+    LOG(INFO) << "retrying " << retries.size()
+              << " pids that were deferred or claimed by another run";
+  }
+  const struct timespec nap = {0, 10000000};
+  while (!retries.empty()) {
+    nanosleep(&nap, NULL);
+    for (size_t i = 0; i < retries.size();) {
+      retry &r = retries[i];
+      bool again = false;
+      switch (enforce_claimed(ledger, r.target, resource, &status, &reason)) {
+        case ATTEMPT_DEFERRED:
+          if (r.deadline == 0) {
+            r.deadline = now_ms() + FLAGS_defer_ms;
+          }
+          again = now_ms() < r.deadline;
+          if (!again) {
+            LOG(WARNING) << "giving up on pid " << r.target << ", " << reason;
+            status |= 1;
+          }
+          break;
+        case ATTEMPT_BUSY:
+          again = true;
+          break;
+        case ATTEMPT_FINISHED:
+          break;
+      }
+      if (again) {
+        i++;
+      } else {
+        retries[i] = retries.back();
+        retries.pop_back();
+      }
+    }
+  }
+  if (reap_abandoned(FLAGS_wait_timeout_ms)) {
+    LOG(WARNING) << "some timed out pids never stopped, they are released "
+                 << "when setrlimit exits";
+  }
+  if (ledger != NULL) {
+    ledger_close(ledger);
   }
   if (status && geteuid() != 0) {
     LOG(ERROR) << "some processes failed, may want to retry as root";
@@ -0,0 +1,153 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./pickthread.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+#include <glog/logging.h>
+
+#include "./procstat.h"
+
+// syscalls a thread parks in while it has nothing to do
+static const long idle_syscalls[] = {
+    SYS_futex,        SYS_epoll_wait, SYS_epoll_pwait, SYS_poll,
+    SYS_ppoll,        SYS_select,     SYS_pselect6,    SYS_nanosleep,
+    SYS_clock_nanosleep, SYS_wait4,   SYS_rt_sigtimedwait, SYS_pause,
+};
+
+// kernel functions those syscalls sleep in, as shown in wchan
+static const char *idle_wchans[] = {
+    "futex", "epoll", "poll", "select", "nanosleep", "wait", "sigtimedwait",
+};
+
+enum quietness {
+  QUIET_UNUSABLE,  // stopped, dead or in uninterruptible sleep
+  QUIET_RUNNING,
+  QUIET_SLEEPING,
+  QUIET_IDLE,  // sleeping in one of idle_syscalls
+};
+
+static const char *describe(enum quietness q) {
+  switch (q) {
+    case QUIET_IDLE:
+      return "blocked in an idle wait";
+    case QUIET_SLEEPING:
+      return "sleeping";
+    case QUIET_RUNNING:
+      return "running, no quieter thread";
+    default:
+      return "no usable thread, using pid as given";
+  }
+}
+
+static enum quietness rate_task(pid_t tgid, pid_t tid) {
+  char path[PATH_MAX], buf[256];
+  snprintf(path, sizeof(path), "%s/%d/task/%d/stat", proc_root(), tgid, tid);
+  if (read_proc_file(path, buf, sizeof(buf)) <= 0) {
+    return QUIET_UNUSABLE;
+  }
+  const char *p = strrchr(buf, ')');
+  if (p == NULL || p[1] != ' ') {
+    return QUIET_UNUSABLE;
+  }
+  switch (p[2]) {
+    case 'R':
+      return QUIET_RUNNING;
+    case 'S':
+    case 'I':
+      break;
+    default:
+      return QUIET_UNUSABLE;
+  }
+
+  // The first field of syscall is the number of the syscall the task is
+  // blocked in, or "running". Reading it needs the same privileges as ptrace,
+  // so fall back to the name of the kernel function in wchan.
+  snprintf(path, sizeof(path), "%s/%d/task/%d/syscall", proc_root(), tgid,
+           tid);
+  if (read_proc_file(path, buf, sizeof(buf)) <= 0) {
+    snprintf(path, sizeof(path), "%s/%d/task/%d/wchan", proc_root(), tgid,
+             tid);
+    if (read_proc_file(path, buf, sizeof(buf)) <= 0) {
+      return QUIET_SLEEPING;
+    }
+    for (size_t i = 0; i < sizeof(idle_wchans) / sizeof(idle_wchans[0]); i++) {
+      if (strstr(buf, idle_wchans[i]) != NULL) {
+        return QUIET_IDLE;
+      }
+    }
+    return QUIET_SLEEPING;
+  }
+  char *end;
+  const long nr = strtol(buf, &end, 10);
+  if (end == buf) {
+    return QUIET_SLEEPING;
+  }
+  for (size_t i = 0; i < sizeof(idle_syscalls) / sizeof(idle_syscalls[0]);
+       i++) {
+    if (nr == idle_syscalls[i]) {
+      return QUIET_IDLE;
+    }
+  }
+  return QUIET_SLEEPING;
+}
+
+pid_t PickQuietThread(pid_t pid, const char **why) {
+  *why = "tasks not readable, using pid as given";
+  struct proc_status status;
+  if (!read_proc_status(pid, &status)) {
+    return pid;
+  }
+
+  char path[PATH_MAX];
+  proc_path(path, sizeof(path), status.tgid, "task");
+  DIR *dir = opendir(path);
+  if (dir == nullptr) {
+    return pid;
+  }
+
+  pid_t best = pid;
+  enum quietness best_q = QUIET_UNUSABLE;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != nullptr) {
+    char *end;
+    const long tid = strtol(ent->d_name, &end, 10);
+    if (tid <= 0 || *end != '\0') {
+      continue;
+    }
+    const enum quietness q = rate_task(status.tgid, tid);
+    VLOG(1) << "pid " << pid << " thread " << tid << " rates " << q;
+    if (q > best_q) {
+      best = tid;
+      best_q = q;
+      if (q == QUIET_IDLE) {
+        break;
+      }
+    }
+  }
+  closedir(dir);
+
+  *why = describe(best_q);
+  return best;
+}
@@ -0,0 +1,28 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <sys/types.h>
+
+// rlimits are per process, so any thread of pid can make the syscall. Pick
+// the thread that is least disruptive to stop: one already blocked in a
+// futex, epoll or similar wait, then any sleeping thread, then whatever is
+// left. Falls back to pid if its tasks cannot be read. A short description
+// of why the thread was picked is stored in *why.
+pid_t PickQuietThread(pid_t pid, const char **why);
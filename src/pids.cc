@@ -40,21 +40,30 @@ size_t pids_push(struct pids *pids, pid_t value) {
   }
   if (!found) {
     VLOG(1) << "pid " << value << " not found";
-    pids->pids[pids->sz++] = value;
+    pids_append(pids, value);
   } else {
     VLOG(1) << "found pid " << value;
   }
   return pids->sz;
 }
 
+size_t pids_append(struct pids *pids, pid_t value) {
+  if (pids->sz == pids->cap) {
+    pids->cap *= 2;
+    pids->pids = (pid_t *)realloc(pids->pids, pids->cap * sizeof(pid_t));
+  }
+  pids->pids[pids->sz++] = value;
+  return pids->sz;
+}
+
 pid_t pids_pop(struct pids *pids, size_t *size) {
   assert(pids->sz);
   pid_t ret = pids->pids[0];
   pids->sz--;
-  memmove(pids->pids, pids->pids + 1, pids->sz);
-  if (pids->cap > (pids->sz * 2)) {
+  memmove(pids->pids, pids->pids + 1, pids->sz * sizeof(pid_t));
+  if (pids->cap > DEFAULT_SZ && pids->cap > (pids->sz * 2)) {
     pids->cap /= 2;
-    pids->pids = (pid_t *)realloc(pids->pids, pids->cap);
+    pids->pids = (pid_t *)realloc(pids->pids, pids->cap * sizeof(pid_t));
   }
   if (size != NULL) {
     *size = pids->sz;
@@ -33,6 +33,9 @@ typedef size_t (*pusher_t)(struct pids *, pid_t value);
 
 size_t pids_push(struct pids *, pid_t value);
 
+// Like pids_push, for callers that already know value is not present.
+size_t pids_append(struct pids *, pid_t value);
+
 pid_t pids_pop(struct pids *pids, size_t *size);
 
 void pids_print(struct pids *pids);
@@ -0,0 +1,110 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./planner.h"
+
+#include <sys/resource.h>
+
+#include <glog/logging.h>
+
+#include <map>
+#include <vector>
+
+#include "./procstat.h"
+#include "./rlim.h"
+
+// PTRACE_INTERRUPT plus a single step each for getrlimit and setrlimit.
+#define STOPS_PER_PATCH 3
+// A target that turns out to be fine still costs the interrupt and getrlimit.
+#define STOPS_PER_NOOP 2
+
+namespace {
+struct plan_entry {
+  pid_t tgid;
+  pid_t ppid;
+  bool diverges;
+  bool forks;
+};
+}  // namespace
+
+size_t PlanDivergentTargets(struct pids *pids, int resource) {
+  std::vector<plan_entry> procs;
+  std::map<pid_t, size_t> seen;
+  for (size_t i = 0; i < pids->sz; i++) {
+    struct proc_status status;
+    if (!read_proc_status(pids->pids[i], &status)) {
+      LOG(WARNING) << "pid " << pids->pids[i] << " went away while planning";
+      continue;
+    }
+    if (seen.count(status.tgid)) {
+      VLOG(1) << "task " << pids->pids[i] << " is covered by thread group "
+              << status.tgid;
+      continue;
+    }
+
+    struct proc_stat st;
+    struct rlimit limits[RLIM_NLIMITS];
+    if (!read_proc_stat(status.tgid, &st) ||
+        !read_proc_limits(status.tgid, limits)) {
+      LOG(WARNING) << "pid " << status.tgid << " went away while planning";
+      continue;
+    }
+
+    plan_entry e;
+    e.tgid = status.tgid;
+    e.ppid = st.ppid;
+    e.diverges = limits[resource].rlim_cur != limits[resource].rlim_max;
+    e.forks = false;
+    seen[e.tgid] = procs.size();
+    procs.push_back(e);
+  }
+
+  for (const auto &e : procs) {
+    const auto parent = seen.find(e.ppid);
+    if (parent != seen.end()) {
+      procs[parent->second].forks = true;
+    }
+  }
+
+  // pids are discovered breadth first, so keeping discovery order patches
+  // ancestors before their descendants.
+  const size_t naive = pids->sz;
+  size_t ancestors = 0, leaves = 0;
+  pids->sz = 0;
+  for (const auto &e : procs) {
+    if (!e.diverges) {
+      VLOG(1) << "plan: skip pid " << e.tgid << ", limit already at hard max";
+      continue;
+    }
+    if (e.forks) {
+      ancestors++;
+      LOG(INFO) << "plan: patch forking ancestor " << e.tgid;
+    } else {
+      leaves++;
+      LOG(INFO) << "plan: patch diverging descendant " << e.tgid;
+    }
+    pids->pids[pids->sz++] = e.tgid;
+  }
+
+  const size_t stops = pids->sz * STOPS_PER_PATCH;
+  LOG(INFO) << "plan: " << pids->sz << " of " << naive << " tasks need patching ("
+            << ancestors << " forking ancestors, " << leaves
+            << " descendants), estimated " << stops << " ptrace stops instead of "
+            << naive * STOPS_PER_NOOP << " to " << naive * STOPS_PER_PATCH;
+  return stops;
+}
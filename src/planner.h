@@ -0,0 +1,34 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "./pids.h"
+
+// Replace the discovered pids with the processes that still need resource
+// patched. This is a filter rather than a cover computation: threads are
+// collapsed into their thread group (rlimits are per process), and processes
+// whose soft limit already equals the hard limit are dropped. Discovery order
+// is kept, so forking ancestors are patched before the children they may
+// fork during the run; whether a process forks only changes how it is
+// logged. The plan is logged, and the estimated number of ptrace stops is
+// returned.
+size_t PlanDivergentTargets(struct pids *pids, int resource);
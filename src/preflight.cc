@@ -0,0 +1,64 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./preflight.h"
+
+#include <errno.h>
+
+#include <glog/logging.h>
+
+#include "./procstat.h"
+
+enum preflight preflight_classify(pid_t pid, const char **reason) {
+  struct proc_stat st;
+  struct proc_status status;
+  errno = 0;
+  if (!read_proc_stat(pid, &st) || !read_proc_status(pid, &status)) {
+    *reason = errno == EMFILE || errno == ENFILE ? "out of file descriptors"
+                                                 : "process is gone";
+    return PREFLIGHT_SKIP;
+  }
+  if (status.tracer_pid != 0) {
+    *reason = "already traced by another process";
+    return PREFLIGHT_SKIP;
+  }
+
+  VLOG(1) << "pid " << pid << " is in state " << st.state;
+  switch (st.state) {
+    case 'R':
+    case 'S':
+    case 'I':
+      return PREFLIGHT_READY;
+    case 'D':
+      *reason = "in uninterruptible sleep";
+      return PREFLIGHT_DEFER;
+    case 'T':
+      *reason = "job-stopped";
+      return PREFLIGHT_SKIP;
+    case 't':
+      *reason = "in a tracing stop";
+      return PREFLIGHT_SKIP;
+    case 'Z':
+    case 'X':
+      *reason = "exiting";
+      return PREFLIGHT_SKIP;
+    default:
+      LOG(WARNING) << "pid " << pid << " has unknown state " << st.state;
+      return PREFLIGHT_READY;
+  }
+}
@@ -0,0 +1,32 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <sys/types.h>
+
+enum preflight {
+  PREFLIGHT_READY,  // running or sleeping, safe to attach now
+  PREFLIGHT_DEFER,  // in uninterruptible sleep, retry until a deadline
+  PREFLIGHT_SKIP,   // cannot be attached to, see reason
+};
+
+// Classify pid from /proc/PID/stat and /proc/PID/status before attaching, so
+// that targets that would block or fail in enforce() are routed elsewhere.
+// For PREFLIGHT_DEFER and PREFLIGHT_SKIP, *reason is set to a static string.
+enum preflight preflight_classify(pid_t pid, const char **reason);
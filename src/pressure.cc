@@ -0,0 +1,175 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./pressure.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+#include "./procstat.h"
+#include "./rlim.h"
+
+static bool finite(const struct usage *u, int resource) {
+  return u->limits[resource].rlim_cur != RLIM_INFINITY;
+}
+
+// All files are opened relative to the proc root fd and read into a stack
+// buffer, so sampling does not allocate and costs one open per file. Usage
+// against an unlimited soft limit always has full headroom, so limits are
+// read first and the files that only feed such a resource are skipped; most
+// of the cost of a sample is the kernel formatting each file.
+bool sample_usage(pid_t pid, struct usage *u) {
+  const int rootfd = proc_root_fd();
+  if (rootfd == -1) {
+    return false;
+  }
+
+  char path[32];
+  char buf[4096];
+  proc_relpath(path, sizeof(path), pid, "limits");
+  if (read_proc_file_at(rootfd, path, buf, sizeof(buf)) <= 0) {
+    return false;
+  }
+  parse_proc_limits(buf, pid, u->limits);
+  u->pid = pid;
+  u->fds = -1;
+  u->threads = 0;
+  u->vsize = 0;
+  u->locked = 0;
+
+  if (finite(u, RLIMIT_NPROC) || finite(u, RLIMIT_AS)) {
+    struct proc_stat st;
+    proc_relpath(path, sizeof(path), pid, "stat");
+    if (read_proc_file_at(rootfd, path, buf, sizeof(buf)) <= 0 ||
+        !parse_proc_stat(buf, pid, &st)) {
+      return false;
+    }
+    u->threads = st.num_threads;
+    u->vsize = st.vsize;
+  }
+  if (finite(u, RLIMIT_MEMLOCK)) {
+    struct proc_status status;
+    proc_relpath(path, sizeof(path), pid, "status");
+    if (read_proc_file_at(rootfd, path, buf, sizeof(buf)) <= 0) {
+      return false;
+    }
+    parse_proc_status(buf, pid, &status);
+    u->locked = status.vm_lck;
+  }
+  if (finite(u, RLIMIT_NOFILE)) {
+    proc_relpath(path, sizeof(path), pid, "fd");
+    u->fds = count_proc_fds(rootfd, path);
+  }
+  return true;
+}
+
+static double ratio(const struct rlimit &lim, unsigned long used) {
+  if (lim.rlim_cur == RLIM_INFINITY) {
+    return 1.0;
+  }
+  if (lim.rlim_cur == 0 || used >= lim.rlim_cur) {
+    return 0.0;
+  }
+  return 1.0 - (double)used / lim.rlim_cur;
+}
+
+double headroom(const struct usage *u, int resource) {
+  // RLIMIT_NPROC counts every task owned by the user, so the thread count of
+  // one process is only a lower bound on its usage.
+  const double nofile =
+      u->fds < 0 ? 1.0 : ratio(u->limits[RLIMIT_NOFILE], u->fds);
+  const double nproc = ratio(u->limits[RLIMIT_NPROC], u->threads);
+  const double as = ratio(u->limits[RLIMIT_AS], u->vsize);
+  const double memlock = ratio(u->limits[RLIMIT_MEMLOCK], u->locked);
+  switch (resource) {
+    case RLIMIT_NOFILE:
+      return nofile;
+    case RLIMIT_NPROC:
+      return nproc;
+    case RLIMIT_AS:
+      return as;
+    case RLIMIT_MEMLOCK:
+      return memlock;
+    default:
+      return std::min(std::min(nofile, nproc), std::min(as, memlock));
+  }
+}
+
+namespace {
+struct pressure {
+  double room;
+  struct usage u;
+};
+}  // namespace
+
+void SortByPressure(struct pids *pids, int resource, size_t top) {
+  // Usage and limits belong to the thread group, so each group is sampled,
+  // ranked and enforced once, as its leader.
+  std::vector<pressure> order;
+  std::unordered_set<pid_t> seen;
+  order.reserve(pids->sz);
+  for (size_t i = 0; i < pids->sz; i++) {
+    pid_t pid = pids->pids[i];
+    struct proc_status status;
+    if (read_proc_status(pid, &status)) {
+      if (!seen.insert(status.tgid).second) {
+        VLOG(1) << "task " << pid << " is ranked as thread group "
+                << status.tgid;
+        continue;
+      }
+      pid = status.tgid;
+    }
+
+    pressure p;
+    p.room = 1.0;
+    if (sample_usage(pid, &p.u)) {
+      p.room = headroom(&p.u, resource);
+    } else {
+      LOG(WARNING) << "failed to sample usage for pid " << pid;
+      memset(&p.u, 0, sizeof(p.u));
+      p.u.pid = pid;
+      p.u.fds = -1;
+    }
+    order.push_back(p);
+  }
+
+  std::stable_sort(order.begin(), order.end(),
+                   [](const pressure &a, const pressure &b) {
+                     return a.room < b.room;
+                   });
+
+  pids->sz = order.size();
+  for (size_t i = 0; i < order.size(); i++) {
+    const struct usage &u = order[i].u;
+    pids->pids[i] = u.pid;
+    if (i < top) {
+      LOG(INFO) << "pressure #" << (i + 1) << ": pid " << u.pid << " has "
+                << (order[i].room * 100) << "% headroom (fds " << u.fds << "/"
+                << u.limits[RLIMIT_NOFILE].rlim_cur << ", threads "
+                << u.threads << "/" << u.limits[RLIMIT_NPROC].rlim_cur
+                << ", vsize " << u.vsize << "/"
+                << u.limits[RLIMIT_AS].rlim_cur << ")";
+    }
+  }
+}
@@ -0,0 +1,51 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "./pids.h"
+
+// Cheap utilization signals for a single process, all read from /proc.
+struct usage {
+  pid_t pid;
+  long fds;              // open file descriptors, -1 if unknown
+  long threads;          // tasks in the thread group
+  unsigned long vsize;   // virtual memory size in bytes
+  unsigned long locked;  // locked memory in bytes
+  struct rlimit limits[RLIM_NLIMITS];
+};
+
+// Sample the current usage of pid. Usage that only counts against an
+// unlimited soft limit is not read and left at 0 (-1 for fds). Returns false
+// if the process is gone.
+bool sample_usage(pid_t pid, struct usage *u);
+
+// The fraction of the soft limit for resource that is still available, from
+// 0.0 (exhausted) to 1.0 (unlimited or unused). For resources that are not
+// sampled this is the smallest headroom across the sampled ones.
+double headroom(const struct usage *u, int resource);
+
+// Collapse pids to one entry per thread group (its leader) and order them so
+// that the processes with the least headroom for resource are enforced
+// first, and report the top n before any work begins.
+void SortByPressure(struct pids *pids, int resource, size_t top);
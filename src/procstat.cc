@@ -0,0 +1,243 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./procstat.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#include <glog/logging.h>
+
+#ifndef PROC_SUPER_MAGIC
+#define PROC_SUPER_MAGIC 0x9fa0
+#endif
+
+static char root_path[PATH_MAX] = "/proc";
+static int root_is_procfs = -1;
+static int root_fd = -1;
+
+void set_proc_root(const char *root) {
+  snprintf(root_path, sizeof(root_path), "%s", root);
+  root_is_procfs = -1;
+  if (root_fd != -1) {
+    close(root_fd);
+    root_fd = -1;
+  }
+}
+
+int proc_root_fd(void) {
+  if (root_fd == -1) {
+    root_fd = open(root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+      VLOG(1) << "failed to open " << root_path << ": " << strerror(errno);
+    }
+  }
+  return root_fd;
+}
+
+const char *proc_root(void) { return root_path; }
+
+bool proc_root_is_procfs(void) {
+  if (root_is_procfs == -1) {
+    struct statfs fs;
+    root_is_procfs =
+        statfs(root_path, &fs) == 0 && fs.f_type == PROC_SUPER_MAGIC;
+  }
+  return root_is_procfs;
+}
+
+void proc_path(char *buf, size_t sz, pid_t pid, const char *file) {
+  snprintf(buf, sz, "%s/%d/%s", root_path, pid, file);
+}
+
+void proc_relpath(char *buf, size_t sz, pid_t pid, const char *file) {
+  snprintf(buf, sz, "%d/%s", pid, file);
+}
+
+int open_proc_dir(pid_t pid) {
+  char path[32];
+  snprintf(path, sizeof(path), "%d", pid);
+  return openat(proc_root_fd(), path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+ssize_t read_proc_file(const char *path, char *buf, size_t sz) {
+  return read_proc_file_at(AT_FDCWD, path, buf, sz);
+}
+
+ssize_t read_proc_file_at(int dirfd, const char *path, char *buf, size_t sz) {
+  // errno is preserved for callers that tell a vanished process (ENOENT,
+  // ESRCH) from running out of fds (EMFILE)
+  const int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    const int err = errno;
+    VLOG(1) << "failed to open " << path << ": " << strerror(err);
+    errno = err;
+    return -1;
+  }
+  size_t off = 0;
+  while (off + 1 < sz) {
+    const ssize_t n = read(fd, buf + off, sz - off - 1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      const int err = errno;
+      VLOG(1) << "failed to read " << path << ": " << strerror(err);
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    off += n;
+    // procfs files are produced by a single read when the buffer is large
+    // enough, so a short read is treated as end of file rather than paying
+    // for a second read just to see 0.
+    if (n == 0 || (size_t)n < sz - (off - n) - 1) {
+      break;
+    }
+  }
+  buf[off] = '\0';
+  close(fd);
+  return off;
+}
+
+bool read_proc_stat(pid_t pid, struct proc_stat *st) {
+  char path[PATH_MAX];
+  proc_path(path, sizeof(path), pid, "stat");
+
+  char buf[1024];
+  if (read_proc_file(path, buf, sizeof(buf)) <= 0) {
+    return false;
+  }
+  return parse_proc_stat(buf, pid, st);
+}
+
+bool parse_proc_stat(const char *buf, pid_t pid, struct proc_stat *st) {
+  // comm may contain spaces and parens, so fields are counted from the last
+  // closing paren rather than from the start of the line.
+  const char *p = strrchr(buf, ')');
+  if (p == NULL) {
+    LOG(WARNING) << "malformed stat file for pid " << pid;
+    return false;
+  }
+
+  st->pid = pid;
+  int field = 2;
+  const char *tok = p + 1;
+  while (*tok) {
+    while (*tok == ' ') {
+      tok++;
+    }
+    if (*tok == '\0') {
+      break;
+    }
+    field++;
+    switch (field) {
+      case 3:
+        st->state = *tok;
+        break;
+      case 4:
+        st->ppid = strtol(tok, NULL, 10);
+        break;
+      case 20:
+        st->num_threads = strtol(tok, NULL, 10);
+        break;
+      case 22:
+        st->starttime = strtoull(tok, NULL, 10);
+        break;
+      case 23:
+        st->vsize = strtoul(tok, NULL, 10);
+        return true;
+    }
+    while (*tok && *tok != ' ') {
+      tok++;
+    }
+  }
+  LOG(WARNING) << "short stat file for pid " << pid;
+  return false;
+}
+
+bool read_proc_status(pid_t pid, struct proc_status *st) {
+  char path[PATH_MAX];
+  proc_path(path, sizeof(path), pid, "status");
+
+  char buf[4096];
+  if (read_proc_file(path, buf, sizeof(buf)) <= 0) {
+    return false;
+  }
+  parse_proc_status(buf, pid, st);
+  return true;
+}
+
+void parse_proc_status(const char *buf, pid_t pid, struct proc_status *st) {
+  st->tgid = pid;
+  st->tracer_pid = 0;
+  st->vm_lck = 0;
+  for (const char *line = buf; line != NULL && *line;) {
+    if (strncmp(line, "Tgid:", 5) == 0) {
+      st->tgid = strtol(line + 5, NULL, 10);
+    } else if (strncmp(line, "TracerPid:", 10) == 0) {
+      st->tracer_pid = strtol(line + 10, NULL, 10);
+    } else if (strncmp(line, "VmLck:", 6) == 0) {
+      st->vm_lck = strtoul(line + 6, NULL, 10) * 1024;
+    }
+    line = strchr(line, '\n');
+    if (line != NULL) {
+      line++;
+    }
+  }
+}
+
+// Recent kernels report the number of open fds as the size of /proc/PID/fd,
+// which saves a readdir over what may be a very large directory. Other
+// filesystems (e.g. a synthetic tree on tmpfs) report something else.
+long count_proc_fds(int dirfd, const char *path) {
+  struct stat st;
+  if (fstatat(dirfd, path, &st, 0)) {
+    return -1;
+  }
+  if (st.st_size > 0 && proc_root_is_procfs()) {
+    return st.st_size;
+  }
+
+  const int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  DIR *dir = fdopendir(fd);
+  if (dir == nullptr) {
+    close(fd);
+    return -1;
+  }
+  long n = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != nullptr) {
+    if (ent->d_name[0] != '.') {
+      n++;
+    }
+  }
+  closedir(dir);
+  return n;
+}
@@ -0,0 +1,88 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+// Use root instead of /proc for every procfs read, e.g. a synthetic tree
+// written by genproc.
+void set_proc_root(const char *root);
+const char *proc_root(void);
+
+// Whether the proc root is a real procfs, whose directory sizes are
+// meaningful (e.g. the size of /proc/PID/fd is the number of open fds).
+bool proc_root_is_procfs(void);
+
+// A directory fd for the proc root, opened once and kept for the life of
+// the process, so per-process files can be read with openat("PID/file")
+// instead of resolving the root each time. Returns -1 if it cannot be opened.
+int proc_root_fd(void);
+
+// Format ROOT/PID/file into buf.
+void proc_path(char *buf, size_t sz, pid_t pid, const char *file);
+
+// Format PID/file, relative to proc_root_fd(), into buf.
+void proc_relpath(char *buf, size_t sz, pid_t pid, const char *file);
+
+// Open ROOT/PID as a directory fd, for callers that keep a process open
+// across many reads. Returns -1 if the process is gone.
+int open_proc_dir(pid_t pid);
+
+// The subset of /proc/PID/stat that setrlimit cares about.
+struct proc_stat {
+  pid_t pid;
+  char state;
+  pid_t ppid;
+  long num_threads;
+  unsigned long long starttime;
+  unsigned long vsize;
+};
+
+// The subset of /proc/PID/status that setrlimit cares about.
+struct proc_status {
+  pid_t tgid;
+  pid_t tracer_pid;
+  unsigned long vm_lck;  // locked memory in bytes
+};
+
+// Read /proc/PID/stat into st. Returns false if the process is gone or the
+// file could not be parsed.
+bool read_proc_stat(pid_t pid, struct proc_stat *st);
+
+// Read /proc/PID/status into st. Returns false if the process is gone.
+bool read_proc_status(pid_t pid, struct proc_status *st);
+
+// Parse the contents of a stat or status file read by the caller.
+bool parse_proc_stat(const char *buf, pid_t pid, struct proc_stat *st);
+void parse_proc_status(const char *buf, pid_t pid, struct proc_status *st);
+
+// Read the whole of path into buf (NUL terminated) without allocating.
+// Returns the number of bytes read, or -1 on error.
+ssize_t read_proc_file(const char *path, char *buf, size_t sz);
+
+// The number of open fds in the fd directory at path relative to dirfd (e.g.
+// "fd" under open_proc_dir(), or "PID/fd" under proc_root_fd()), or -1 if it
+// cannot be read.
+long count_proc_fds(int dirfd, const char *path);
+
+// Like read_proc_file, for a path relative to dirfd.
+ssize_t read_proc_file_at(int dirfd, const char *path, char *buf, size_t sz);
@@ -40,39 +40,29 @@
 #include <iterator>
 #include <memory>
 #include <sstream>
-#include <set>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
+#include "./procstat.h"
 #include "./tolong.h"
 
 size_t AddChildren(struct pids *pids) {
   LOG(INFO) << "in AddChildren";
-  assert(pids->sz == 1);
 
-  bool first = true;
-  size_t s = 0, e = 1;
+  // Each round reads the tasks of the previous round's children, so the tree
+  // is walked breadth first. seen keeps deduplication O(1) on large hosts.
+  std::unordered_set<pid_t> seen(pids->pids, pids->pids + pids->sz);
+  std::vector<pid_t> targets(pids->pids, pids->pids + pids->sz), children;
   size_t total = 0;
   size_t loop_no = 0;
-  while (true) {
-    LOG(INFO) << "in looop number " << loop_no++;
-    size_t loop_total = 0;
-    std::vector<pid_t> targets, children;
-    LOG(INFO) << "first = " << first;
-    if (first) {
-      first = false;
-      targets.push_back(pids->pids[0]);
-    } else {
-      for (size_t i = s; i < e; i++) {
-        targets.push_back(pids->pids[i]);
-      }
-    }
-    LOG(INFO) << "add_children, s = " << s << ", e = " << e
-              << ", target.size() = " << targets.size();
+  while (!targets.empty()) {
+    LOG(INFO) << "in loop number " << loop_no++
+              << ", targets.size() = " << targets.size();
+    children.clear();
     for (const auto &t : targets) {
-      LOG(INFO) << "in a targets loop of " << targets.size();
       std::stringstream ss;
-      ss << "/proc/" << t << "/task/";
+      ss << proc_root() << "/" << t << "/task/";
       const std::string task_line = ss.str();
 
       DIR *task_dir = opendir(task_line.c_str());
@@ -90,7 +80,7 @@ size_t AddChildren(struct pids *pids) {
         assert(task_dir != nullptr);
         const int ret = readdir_r(task_dir, &ent, &rslt);
         if (ret || rslt == NULL) {
-          LOG(INFO) << "finished reading directory";
+          VLOG(1) << "finished reading directory";
           break;
         }
 
@@ -99,7 +89,7 @@ size_t AddChildren(struct pids *pids) {
         val = strtol(ent.d_name, &endptr, 10);
         if ((errno == ERANGE && (val == LONG_MIN || val == LONG_MAX)) ||
             (errno != 0 && val == 0)) {
-          LOG(INFO) << "encountered not a pid";
+          VLOG(1) << "encountered not a pid";
           continue;  // this is not a pid
         }
         if (*endptr != '\0') {
@@ -110,55 +100,47 @@ size_t AddChildren(struct pids *pids) {
           LOG(INFO) << ent.d_name << " cowardly refusing to handle pid " << val;
           continue;
         }
-        LOG(INFO) << "found child " << val;
+        VLOG(1) << "found task " << val;
 
-        pids_push(pids, val);
+        if (seen.insert(val).second) {
+          pids_append(pids, val);
+        }
 
         std::stringstream sss;
         sss << task_line << val << "/children";
         const std::string s_copy = sss.str();
-        LOG(INFO) << "trying to open " << s_copy;
+        VLOG(1) << "trying to open " << s_copy;
         std::ifstream children_file(s_copy);
         if (!children_file.good()) {
-          LOG(WARNING) << "children file not good";
+          LOG(WARNING) << "children file " << s_copy << " not good";
           continue;
         }
 
         std::string line;
         std::getline(children_file, line);
-        LOG(INFO) << "line sz is " << line.size();
 
         std::stringstream lss(line);
         std::vector<int> vchild{std::istream_iterator<int>(lss),
                                 std::istream_iterator<int>()};
 
-        loop_total += vchild.size();
-
-        LOG(INFO) << "vchild_size " << vchild.size();
-
         for (size_t i = 0; i < vchild.size(); i++) {
-          LOG(INFO) << "i = " << i << ", etnry is pid " << vchild[i];
-          pids_push(pids, vchild[i]);
+          VLOG(1) << "i = " << i << ", entry is pid " << vchild[i];
+          if (seen.insert(vchild[i]).second) {
+            pids_append(pids, vchild[i]);
+            children.push_back(vchild[i]);
+          }
         }
       }
-      LOG(INFO) << "about to call closedir, loop_total = " << loop_total;
 
       assert(task_dir != NULL);
       closedir(task_dir);
     }
 
-    LOG(INFO) << targets.size()
-              << " targets finished, loop_total = " << loop_total;
-
-    if (loop_total) {
-      s = e;
-      e += loop_total;
-      total += loop_total;
-      LOG(INFO) << "total = " << total << ", loop_total = " << loop_total
-                << ", sz = " << pids->sz << ", s = " << s << ", e = " << e;
-    } else {
-      break;
-    }
+    total += children.size();
+    LOG(INFO) << targets.size() << " targets finished, found "
+              << children.size() << " children, total = " << total
+              << ", sz = " << pids->sz;
+    targets.swap(children);
   }
-  return 0;
+  return total;
 }
@@ -22,5 +22,6 @@
 
 #include "./pids.h"
 
-// add all descedants
+// Add all descendants (and their threads) of the pids, breadth first, reading
+// from proc_root(). Returns the number of descendant processes found.
 size_t AddChildren(struct pids *pids);
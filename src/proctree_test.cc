@@ -0,0 +1,175 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Runs discovery and the /proc parsers against a tree written by genproc and
+// checks them against what genproc writes. Driven by genproc_test.sh:
+//
+//   proctree_test ROOT PROCESSES FANOUT THREADS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <glog/logging.h>
+
+#include <vector>
+
+#include "./pids.h"
+#include "./planner.h"
+#include "./procstat.h"
+#include "./proctree.h"
+#include "./rlim.h"
+
+static int failures = 0;
+
+#define EXPECT_EQ(a, b)                                                    \
+  do {                                                                     \
+    if ((long long)(a) != (long long)(b)) {                                \
+      fprintf(stderr, "%s:%d: expected %s == %s, got %lld and %lld\n",     \
+              __FILE__, __LINE__, #a, #b, (long long)(a), (long long)(b)); \
+      failures++;                                                          \
+    }                                                                      \
+  } while (0)
+
+static double elapsed_ms(const struct timespec &start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1e3 +
+         (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+// genproc numbers processes breadth first from 1, with FANOUT children each
+static pid_t expected_ppid(pid_t pid, long fanout) {
+  return pid == 1 ? 0 : (pid - 2) / fanout + 1;
+}
+
+// The plan over all discovered tasks should be exactly the processes whose
+// soft core limit genproc left below the hard limit, in breadth-first (so
+// ascending) order, with their threads collapsed into them.
+static void check_plan(struct pids *pids, long processes) {
+  std::vector<pid_t> expected;
+  for (pid_t pid = 1; pid <= processes; pid++) {
+    struct rlimit limits[RLIM_NLIMITS];
+    if (!read_proc_limits(pid, limits)) {
+      fprintf(stderr, "failed to read limits of pid %d\n", pid);
+      failures++;
+      return;
+    }
+    if (limits[RLIMIT_CORE].rlim_cur != limits[RLIMIT_CORE].rlim_max) {
+      expected.push_back(pid);
+    }
+  }
+
+  PlanDivergentTargets(pids, RLIMIT_CORE);
+  printf("planned %zu of %ld processes\n", pids->sz, processes);
+  EXPECT_EQ(pids->sz, expected.size());
+  for (size_t i = 0; i < pids->sz && i < expected.size(); i++) {
+    EXPECT_EQ(pids->pids[i], expected[i]);
+  }
+}
+
+static void check_process(pid_t pid, long fanout, long threads) {
+  struct proc_stat st;
+  if (!read_proc_stat(pid, &st)) {
+    fprintf(stderr, "failed to read stat of pid %d\n", pid);
+    failures++;
+    return;
+  }
+  EXPECT_EQ(st.pid, pid);
+  EXPECT_EQ(st.ppid, expected_ppid(pid, fanout));
+  EXPECT_EQ(st.num_threads, threads);
+  EXPECT_EQ(st.vsize % 1048576, 0);
+
+  struct proc_status status;
+  if (!read_proc_status(pid, &status)) {
+    fprintf(stderr, "failed to read status of pid %d\n", pid);
+    failures++;
+    return;
+  }
+  EXPECT_EQ(status.tgid, pid);
+  EXPECT_EQ(status.tracer_pid, 0);
+  EXPECT_EQ(status.vm_lck % 1024, 0);
+
+  struct rlimit limits[RLIM_NLIMITS];
+  if (!read_proc_limits(pid, limits)) {
+    fprintf(stderr, "failed to read limits of pid %d\n", pid);
+    failures++;
+    return;
+  }
+  EXPECT_EQ(limits[RLIMIT_NOFILE].rlim_cur, 1024);
+  EXPECT_EQ(limits[RLIMIT_NOFILE].rlim_max, 1048576);
+  EXPECT_EQ(limits[RLIMIT_NPROC].rlim_cur, 4096);
+  EXPECT_EQ(limits[RLIMIT_MEMLOCK].rlim_max, 8388608);
+  EXPECT_EQ(limits[RLIMIT_CORE].rlim_max, RLIM_INFINITY);
+  if (limits[RLIMIT_CORE].rlim_cur != 0) {
+    EXPECT_EQ(limits[RLIMIT_CORE].rlim_cur, RLIM_INFINITY);
+  }
+  EXPECT_EQ(limits[RLIMIT_RTTIME].rlim_cur, RLIM_INFINITY);
+}
+
+int main(int argc, char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  if (argc != 5) {
+    fprintf(stderr, "usage: %s ROOT PROCESSES FANOUT THREADS\n", argv[0]);
+    return 2;
+  }
+  set_proc_root(argv[1]);
+  const long processes = atol(argv[2]);
+  const long fanout = atol(argv[3]);
+  const long threads = atol(argv[4]);
+
+  EXPECT_EQ(proc_root_is_procfs(), false);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct pids *pids = pids_new(1);
+  const size_t descendants = AddChildren(pids);
+  printf("discovered %zu tasks in %.1f ms\n", pids->sz, elapsed_ms(start));
+  EXPECT_EQ(descendants, processes - 1);
+  EXPECT_EQ(pids->sz, processes * threads);
+
+  // threads report their leader as the thread group
+  for (size_t i = 0; i < pids->sz; i++) {
+    struct proc_status status;
+    if (!read_proc_status(pids->pids[i], &status)) {
+      fprintf(stderr, "failed to read status of task %d\n", pids->pids[i]);
+      failures++;
+      continue;
+    }
+    if (pids->pids[i] <= processes) {
+      EXPECT_EQ(status.tgid, pids->pids[i]);
+    } else {
+      EXPECT_EQ(status.tgid <= processes, true);
+    }
+  }
+  check_plan(pids, processes);
+  pids_delete(pids);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (pid_t pid = 1; pid <= processes; pid++) {
+    check_process(pid, fanout, threads);
+  }
+  printf("checked %ld processes in %.1f ms\n", processes, elapsed_ms(start));
+
+  if (failures) {
+    fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -15,8 +15,11 @@
 // You should have received a copy of the GNU General Public License
 // along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
 
+#include "./rlim.h"
+
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <glog/logging.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -28,9 +31,15 @@
 
 #include <memory>
 
-static const char *tbl[] = {"CPU",   "FSIZE",   "DATA",  "STACK",
-                            "CORE",  "RSS",     "NPROC", "BOFILE",
-                            "OFILE", "MEMLOCK", "AS",    NULL};
+#include "./procstat.h"
+
+// indexed by resource, in the kernel's order
+static const char *tbl[] = {
+    "CPU",        "FSIZE",      "DATA",       "STACK",
+    "CORE",       "RSS",        "NPROC",      "NOFILE",
+    "MEMLOCK",    "AS",         "LOCKS",      "SIGPENDING",
+    "MSGQUEUE",   "NICE",       "RTPRIO",     "RTTIME",
+    NULL};
 
 // find the numeric value for a rlimit name
 int rlimit_by_name(const char *name) {
@@ -53,19 +62,63 @@ int rlimit_by_name(const char *name) {
   }
 }
 
-void print_rlimits(void) {
-  size_t off = 0;
-  while (true) {
-    const char *s = (const char *)*(tbl + off);
-    if (s == NULL) {
+const char *rlimit_name(int resource) {
+  if (resource < 0 || resource >= (int)(sizeof(tbl) / sizeof(tbl[0]) - 1)) {
+    return "?";
+  }
+  return tbl[resource];
+}
+
+// parse one column of /proc/PID/limits, e.g. "unlimited" or "1024"
+static rlim_t parse_limit(const char *s) {
+  while (*s == ' ') {
+    s++;
+  }
+  if (strncmp(s, "unlimited", 9) == 0) {
+    return RLIM_INFINITY;
+  }
+  return strtoull(s, NULL, 10);
+}
+
+bool read_proc_limits(pid_t pid, struct rlimit limits[RLIM_NLIMITS]) {
+  char path[PATH_MAX];
+  proc_path(path, sizeof(path), pid, "limits");
+
+  char buf[4096];
+  if (read_proc_file(path, buf, sizeof(buf)) <= 0) {
+    return false;
+  }
+  parse_proc_limits(buf, pid, limits);
+  return true;
+}
+
+void parse_proc_limits(const char *buf, pid_t pid,
+                       struct rlimit limits[RLIM_NLIMITS]) {
+  // The kernel prints one "%-25s %-20s %-20s %-10s" line per resource, in
+  // resource order, after a single header line.
+  const size_t soft_col = 26, hard_col = 47;
+  const char *line = strchr(buf, '\n');
+  int resource = 0;
+  while (line != NULL && resource < RLIM_NLIMITS) {
+    line++;
+    const char *eol = strchr(line, '\n');
+    if (eol == NULL || (size_t)(eol - line) < hard_col) {
       break;
     }
-    LOG(INFO) << s << " (" << off << ")";
-    off++;
+    limits[resource].rlim_cur = parse_limit(line + soft_col);
+    limits[resource].rlim_max = parse_limit(line + hard_col);
+    resource++;
+    line = eol;
+  }
+  if (resource < RLIM_NLIMITS) {
+    LOG(WARNING) << "only parsed " << resource << " limits for pid " << pid;
+    for (; resource < RLIM_NLIMITS; resource++) {
+      limits[resource].rlim_cur = limits[resource].rlim_max = RLIM_INFINITY;
+    }
   }
 }
 
-void read_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim) {
+bool read_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim) {
   const size_t sz = sizeof(struct rlimit) / sizeof(long);
   for (size_t i = 0; i < sz; i++) {
     errno = 0;
@@ -74,14 +127,15 @@ void read_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim) {
               << (void *)(where + i * sizeof(long));
     if (word == -1 && errno) {
       perror("ptrace(PTRACE_PEEKTEXT, ...)");
-      exit(1);
+      return false;
     }
     LOG(INFO) << "poking data to " << (long *)(rlim) + i;
     memcpy((long *)(rlim) + i, &word, sizeof(word));
   }
+  return true;
 }
 
-void poke_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim) {
+bool poke_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim) {
   const size_t sz = sizeof(struct rlimit) / sizeof(long);
   for (size_t i = 0; i < sz; i++) {
     long word;
@@ -90,6 +144,8 @@ void poke_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim) {
               << (void *)(where + i * sizeof(long));
     if (ptrace(PTRACE_POKETEXT, pid, where + i * sizeof(long), word)) {
       perror("ptrace(PTRACE_POKETEXT...)");
+      return false;
     }
   }
+  return true;
 }
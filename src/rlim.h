@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/resource.h>
 
@@ -27,9 +28,20 @@
 // Any error will return -1
 int rlimit_by_name(const char *name);
 
-// Print all available rlimits
-void print_rlimits(void);
+// Read the soft and hard limits of every resource for pid from
+// /proc/PID/limits, indexed by resource. Returns false if the file could not
+// be read.
+bool read_proc_limits(pid_t pid, struct rlimit limits[RLIM_NLIMITS]);
 
-void read_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim);
+// Parse the contents of a limits file read by the caller.
+void parse_proc_limits(const char *buf, pid_t pid,
+                       struct rlimit limits[RLIM_NLIMITS]);
 
-void poke_rlimit(pid_t pit, unsigned long where, struct rlimit *rlim);
+// The name of resource, e.g. "NOFILE", or "?" if it is out of range.
+const char *rlimit_name(int resource);
+
+// Copy a struct rlimit out of (or into) the memory of the stopped tracee pid
+// at where. Return false if the memory could not be accessed.
+bool read_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim);
+
+bool poke_rlimit(pid_t pid, unsigned long where, struct rlimit *rlim);
@@ -0,0 +1,220 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./top.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "./pressure.h"
+#include "./procstat.h"
+#include "./rlim.h"
+
+// more threads than this mostly contend on the procfs dentries
+#define MAX_SCAN_THREADS 8
+
+namespace {
+struct row {
+  double room;
+  pid_t pid;
+  int resource;
+  unsigned long used;
+  rlim_t soft;
+};
+
+// the heap keeps the row with the most headroom on top, so it is the one
+// evicted when a more pressured row turns up; ties are broken by pid and
+// resource so the report does not depend on how the scan was split
+bool less_pressured(const row &a, const row &b) {
+  if (a.room != b.room) {
+    return a.room < b.room;
+  }
+  return a.pid != b.pid ? a.pid < b.pid : a.resource < b.resource;
+}
+}  // namespace
+
+static const int report_resources[] = {RLIMIT_NOFILE, RLIMIT_NPROC, RLIMIT_AS,
+                                       RLIMIT_MEMLOCK};
+
+static long used_of(const struct usage &u, int resource) {
+  switch (resource) {
+    case RLIMIT_NOFILE:
+      return u.fds;
+    case RLIMIT_NPROC:
+      return u.threads;
+    case RLIMIT_AS:
+      return u.vsize;
+    case RLIMIT_MEMLOCK:
+      return u.locked;
+    default:
+      return -1;
+  }
+}
+
+static double elapsed_ms(const struct timespec &start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1e3 +
+         (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+// Keep the n rows with the least headroom in heap.
+static void offer(std::vector<row> *heap, size_t n, const row &r) {
+  if (heap->size() < n) {
+    heap->push_back(r);
+    std::push_heap(heap->begin(), heap->end(), less_pressured);
+  } else if (n > 0 && less_pressured(r, heap->front())) {
+    std::pop_heap(heap->begin(), heap->end(), less_pressured);
+    heap->back() = r;
+    std::push_heap(heap->begin(), heap->end(), less_pressured);
+  }
+}
+
+namespace {
+// One scanning thread's share of the work: it claims CHUNK pids at a time
+// from the shared list and keeps its own heap, so threads only meet on the
+// atomic index.
+struct scanner {
+  const std::vector<pid_t> *pids;
+  std::atomic<size_t> *next;
+  size_t n;
+  std::vector<row> heap;
+  size_t scanned;
+};
+}  // namespace
+
+#define CHUNK 64
+
+static void scan(struct scanner *sc) {
+  const std::vector<pid_t> &pids = *sc->pids;
+  size_t begin;
+  while ((begin = sc->next->fetch_add(CHUNK)) < pids.size()) {
+    const size_t end = std::min(begin + CHUNK, pids.size());
+    for (size_t i = begin; i < end; i++) {
+      struct usage u;
+      if (!sample_usage(pids[i], &u)) {
+        continue;  // raced with exit
+      }
+      sc->scanned++;
+
+      for (const int resource : report_resources) {
+        const long used = used_of(u, resource);
+        if (used < 0 || u.limits[resource].rlim_cur == RLIM_INFINITY) {
+          continue;
+        }
+        const row r = {headroom(&u, resource), pids[i], resource,
+                       (unsigned long)used, u.limits[resource].rlim_cur};
+        offer(&sc->heap, sc->n, r);
+      }
+    }
+  }
+}
+
+// Each sample is a few procfs opens and reads that the kernel serves in
+// parallel, so the scan is split over the CPUs setrlimit may run on.
+static size_t scan_threads(size_t npids) {
+  cpu_set_t set;
+  size_t cpus = 1;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    cpus = CPU_COUNT(&set);
+  }
+  const size_t by_work = (npids + 1023) / 1024;
+  return std::max<size_t>(1, std::min(std::min(cpus, by_work),
+                                      (size_t)MAX_SCAN_THREADS));
+}
+
+size_t ReportUtilization(size_t n) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  DIR *dir = opendir(proc_root());
+  if (dir == nullptr) {
+    PLOG(ERROR) << "failed to opendir " << proc_root();
+    return 0;
+  }
+  std::vector<pid_t> pids;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != nullptr) {
+    if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN) {
+      continue;
+    }
+    char *end;
+    const long pid = strtol(ent->d_name, &end, 10);
+    if (pid > 0 && *end == '\0') {
+      pids.push_back(pid);
+    }
+  }
+  closedir(dir);
+
+  // cached lazily otherwise, which would race between the scanners
+  proc_root_fd();
+  proc_root_is_procfs();
+
+  // Only the n most pressured rows are ever kept per thread, so the scan
+  // itself does not allocate per process. n comes from the command line, so
+  // the up front reservation is bounded and a huge n just grows the heap.
+  std::atomic<size_t> next(0);
+  std::vector<scanner> scanners(scan_threads(pids.size()));
+  for (auto &sc : scanners) {
+    sc.pids = &pids;
+    sc.next = &next;
+    sc.n = n;
+    sc.heap.reserve(std::min<size_t>(n, 1024));
+    sc.scanned = 0;
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < scanners.size(); i++) {
+    threads.emplace_back(scan, &scanners[i]);
+  }
+  scan(&scanners[0]);
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  std::vector<row> &heap = scanners[0].heap;
+  size_t scanned = scanners[0].scanned;
+  for (size_t i = 1; i < scanners.size(); i++) {
+    for (const row &r : scanners[i].heap) {
+      offer(&heap, n, r);
+    }
+    scanned += scanners[i].scanned;
+  }
+  std::sort_heap(heap.begin(), heap.end(), less_pressured);
+
+  printf("%-8s %-8s %20s %20s %9s\n", "PID", "RESOURCE", "USED", "SOFT",
+         "HEADROOM");
+  for (const auto &r : heap) {
+    printf("%-8d %-8s %20lu %20llu %8.2f%%\n", r.pid, rlimit_name(r.resource),
+           r.used, (unsigned long long)r.soft, r.room * 100);
+  }
+  printf("scanned %zu processes with %zu threads in %.1f ms\n", scanned,
+         scanners.size(), elapsed_ms(start));
+  return scanned;
+}
@@ -0,0 +1,27 @@
+// Copyright Evan Klitzke <evan@eklitzke.org>, 2016
+//
+// This file is part of setrlimit.
+//
+// Setrlimit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Setrlimit is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Setrlimit.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <stddef.h>
+
+// Scan every process under proc_root() and print the n (process, resource)
+// pairs with the least headroom against their soft limit to stdout. Covers
+// open fds vs NOFILE, threads vs NPROC, vsize vs AS and locked memory vs
+// MEMLOCK. Returns the number of processes scanned.
+size_t ReportUtilization(size_t n);